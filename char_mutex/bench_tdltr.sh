@@ -0,0 +1,33 @@
+#!/bin/sh
+# Compare the throughput of tdltr against `tr a-z A-Z` on the same input and check that both
+# produce identical output.  The tdlchar LKM must be loaded and /dev/tdlchar accessible.
+#
+# Usage: ./bench_tdltr.sh [size_in_MiB]    (default 4096, i.e. 4 GiB)
+
+SIZE_MB=${1:-4096}
+INPUT=$(mktemp /tmp/tdltr_in.XXXXXX)
+OUT_TR=$(mktemp /tmp/tdltr_tr.XXXXXX)
+OUT_TDL=$(mktemp /tmp/tdltr_tdl.XXXXXX)
+trap 'rm -f "$INPUT" "$OUT_TR" "$OUT_TDL"' EXIT
+
+echo "Generating ${SIZE_MB} MiB of input..."
+base64 -w 100 /dev/urandom | head -c "${SIZE_MB}M" > "$INPUT" || exit 1
+
+# Time a command reading $INPUT and writing to the given file, then print MiB/s
+run() {
+   out=$1; shift
+   start=$(date +%s.%N)
+   "$@" < "$INPUT" > "$out" || exit 1
+   end=$(date +%s.%N)
+   echo "$start $end $SIZE_MB" | awk '{ t = $2 - $1; printf "%8.2f s  %10.1f MiB/s\n", t, $3 / t }'
+}
+
+printf "tr a-z A-Z : "; run "$OUT_TR" tr a-z A-Z
+printf "tdltr      : "; run "$OUT_TDL" ./tdltr
+
+if cmp -s "$OUT_TR" "$OUT_TDL"; then
+   echo "Outputs match"
+else
+   echo "Outputs DIFFER" >&2
+   exit 1
+fi
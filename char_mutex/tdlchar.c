@@ -14,6 +14,25 @@
 // FIX For Synchronization problem:
 // --------
 // The original code wasn't process or thread safe.  This code adds a mutex to fix the problem.
+//
+// Each write() is stored as a record in one of several partition queues, and each partition has
+// its own mutex.  The device can be opened by any number of processes at once: writers attach a
+// key to pick the partition (see tdlchar_ioctl.h) so records that share a key stay in order.
+//
+// Readers belong to consumer groups.  Every group sees every record and keeps its own read
+// position (a cursor) in each partition; a record is freed once all groups have read it.  Within a
+// group each partition is owned by one member at a time, so each record goes to exactly one member
+// and per-key ordering holds.
+//
+// Lock order: tdl_groups_lock, then a group's lock, then a partition's lock.
+//
+// Every lock is a struct tdl_lock, a mutex that records how long it was waited for and held.  The
+// totals, log2 histograms and the longest holds (with the pid and command of the holder) are in
+// /sys/kernel/debug/tdlchar/.
+//
+// A read or write that takes longer than slow_read_us or slow_write_us fires the tdlchar_slow_op
+// tracepoint and is remembered, with a breakdown of where the time went, in a small lockless ring
+// shown in /sys/kernel/debug/tdlchar/slow_ops.
 
 #include <linux/init.h>           // Macros used to mark up functions e.g. __init __exitf
 #include <linux/module.h>         // Core header for loading LKMs into the kernel
@@ -21,10 +40,54 @@
 #include <linux/kernel.h>         // Contains types, macros, functions for the kernel
 #include <linux/fs.h>             // Header for the Linux file system support
 #include <linux/uaccess.h>        // Required for the copy to user function
+#include <asm/ioctls.h>           // FIONREAD
+#include <linux/pipe_fs_i.h>      // Pipe buffers for splice()
+#include <linux/splice.h>         // ... and the helpers that fill and drain them
+#include <linux/highmem.h>        // kmap_local_page() of spliced pages
 #include <linux/mutex.h>          // Required for the mutex functionality
+#include <linux/slab.h>           // Required for kmalloc() and kfree()
+#include <linux/vmalloc.h>        // The statistics pages ...
+#include <linux/mm.h>             // ... and mapping them into user space
+#include <linux/list.h>           // Linked lists used for the record queues
+#include <linux/wait.h>           // Wait queues for blocking reads and writes
+#include <linux/poll.h>           // Required for the poll() file operation
+#include <linux/jhash.h>          // Hash function for partitioning keys
+#include <linux/hash.h>           // hash_ptr() for records written without a key
+#include <linux/rcupdate.h>       // Members are freed after an RCU grace period
+#include <linux/shmem_fs.h>       // shmem files that hold spilled records
+#include <linux/falloc.h>         // Punching holes in the spill files once records are read
+#include <linux/debugfs.h>        // Lock statistics are published in debugfs
+#include <linux/seq_file.h>       // ... as seq_file text
+#include <linux/ktime.h>          // Timestamps for lock wait and hold times
+#include <linux/sched.h>          // current, to name the holder of a lock
+#include <linux/spinlock.h>       // Protects the table of longest lock holds and the buffer pool
+#include <linux/nodemask.h>       // Spreading the buffer pool over NUMA nodes
+#include <linux/topology.h>       // numa_node_id()
+#include <linux/percpu.h>         // Per-CPU caches of record pages
+#include <linux/gfp.h>            // alloc_pages() for records larger than a page
+#include <linux/shrinker.h>       // Giving cached pages back under memory pressure
+#include <linux/version.h>        // register_shrinker() changed in 6.0
+#include <linux/workqueue.h>      // The device node is created from a work item
+#include <linux/irq_work.h>       // Kicks the drain of tdlchar_enqueue()'s rings from any context
+#include <linux/btf.h>            // kfuncs for BPF transform programs
+#include <linux/btf_ids.h>        // ... and the set that lists them
+#include <linux/error-injection.h> // fmod_ret programs may only attach to listed functions
+#include <net/genetlink.h>        // Records are multicast to netlink subscribers
+#include "tdlchar_ioctl.h"        // The ioctl interface shared with user space
+#include "tdlchar_genl.h"         // ... and the generic netlink one
+#include "tdlchar_api.h"          // ... and the one for other modules
+
+#define CREATE_TRACE_POINTS
+#include "tdlchar_trace.h"        // The tdlchar_slow_op tracepoint
 
 #define  DEVICE_NAME "tdlchar"    ///< The device will appear at /dev/tdlchar using this value
 #define  CLASS_NAME  "tdl"        ///< The device class -- this is a character device driver
+#define  MAX_PARTITIONS 256       ///< Upper limit for the partitions parameter
+
+// BPF transform programs need the module's BTF and kfunc flags, which came with 6.1
+#if IS_ENABLED(CONFIG_DEBUG_INFO_BTF_MODULES) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+#define  TDL_BPF 1
+#endif
 
 // The license type provides information (via modinfo) but it also affects kernel behavior.
 // You can choose "Proprietary" for non-GPL code, but the kernel will be marked as "tainted".
@@ -36,150 +99,430 @@ MODULE_AUTHOR("Todd Leonhardt");  ///< The author -- visible when you use modinf
 MODULE_DESCRIPTION("A simple Linux char driver");  ///< The description -- see modinfo
 MODULE_VERSION("1.0");            ///< A version number to inform users
 
+static unsigned int partitions = 4;          ///< Number of partition queues
+module_param(partitions, uint, S_IRUGO);    // S_IRUGO can be read/not changed
+MODULE_PARM_DESC(partitions, "Number of partition queues records are hashed into (default 4)");
+
+static unsigned int steal_backlog = 16;      ///< Backlog at which an idle member takes a partition
+module_param(steal_backlog, uint, S_IRUGO);
+MODULE_PARM_DESC(steal_backlog, "Unread records in a partition before an idle group member takes "
+                 "it over from a busier one, 0 to disable (default 16)");
+
+static unsigned int page_cache = 16;         ///< Freed record page blocks kept per CPU and order
+module_param(page_cache, uint, S_IRUGO);
+MODULE_PARM_DESC(page_cache, "Freed page blocks of records larger than a page kept per CPU for "
+                 "reuse, 0 to disable (default 16)");
+
+static unsigned long arena_chunk = 0;        ///< Size of the chunks records are carved from
+module_param(arena_chunk, ulong, S_IRUGO);
+MODULE_PARM_DESC(arena_chunk, "Carve each partition's records out of chunks of this many bytes "
+                 "and free a chunk when all of its records are read, 0 to disable (default 0)");
+
+static unsigned int pool_buffers = 0;        ///< Record buffers allocated at load time
+module_param(pool_buffers, uint, S_IRUGO);
+MODULE_PARM_DESC(pool_buffers, "Full-size record buffers to allocate when the module is loaded, so "
+                 "the first writes don't wait for the allocator, 0 to disable (default 0)");
+
+static bool pool_numa = false;               ///< Spread the pool over the NUMA nodes
+module_param(pool_numa, bool, S_IRUGO);
+MODULE_PARM_DESC(pool_numa, "Spread the pool buffers over the NUMA nodes with memory and take "
+                 "them from the writer's node (default off)");
+
+static bool lock_profile = true;             ///< Time lock waits and holds
+module_param(lock_profile, bool, S_IRUGO);
+MODULE_PARM_DESC(lock_profile, "Measure lock wait and hold times, shown in debugfs (default on)");
+
+static unsigned int slow_read_us = 0;        ///< Reads slower than this are traced and recorded
+module_param(slow_read_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(slow_read_us, "Reads taking longer than this many microseconds are traced and "
+                 "kept in debugfs, 0 to disable (default 0)");
+
+static unsigned int slow_write_us = 0;       ///< Writes slower than this are traced and recorded
+module_param(slow_write_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(slow_write_us, "Writes taking longer than this many microseconds are traced and "
+                 "kept in debugfs, 0 to disable (default 0)");
+
+static unsigned long spill_threshold = 0;    ///< Bytes kept in memory per partition before spilling
+module_param(spill_threshold, ulong, S_IRUGO);
+MODULE_PARM_DESC(spill_threshold, "Bytes of records a partition keeps in memory before the older "
+                 "ones are moved to a swappable shmem file, 0 to disable (default 0)");
+
+static unsigned int ring_slots = 0;          ///< Slots per CPU for tdlchar_enqueue()
+module_param(ring_slots, uint, S_IRUGO);
+MODULE_PARM_DESC(ring_slots, "Records each CPU can hold for tdlchar_enqueue() until they are moved "
+                 "to the partitions, a power of two up to 4096, 0 to disable (default 0)");
+
+static bool deterministic = false;           ///< Bound the latency of every operation
+module_param(deterministic, bool, S_IRUGO);
+MODULE_PARM_DESC(deterministic, "Bound the time each operation takes, for real-time threads: "
+                 "records only come from the pool, locks never spin and nothing is logged or "
+                 "multicast from the data path (default off)");
+
+/** @brief printk() from the data path, which deterministic mode keeps quiet: a console write can
+ *  take milliseconds.
+ */
+#define tdl_printk(fmt, ...)                    \
+   do                                           \
+   {                                            \
+      if (!deterministic)                       \
+      {                                         \
+         printk(fmt, ##__VA_ARGS__);            \
+      }                                         \
+   } while (0)
+
 // Device drivers have an associated major and minor number.  The major number is used by the kernel
 // to identify the correct device driver when the device is accessed.
 static int    majorNumber;                  ///< Stores the device number -- determined automatically
 
-static char   message[256] = {0};           ///< Memory for the string that is passed from userspace
-static short  size_of_message;              ///< Used to remember the size of the string stored
-static int    numberOpens = 0;              ///< Counts the number of times the device is opened
+#define  SPILL_BATCH (64 * 1024)    ///< Most bytes moved to or from a spill file in one go
+#define  MESSAGE_LENGTH ((size_t)READ_ONCE(message_pages) * PAGE_SIZE)  ///< Largest record
+#define  TDL_RECORD_MAX (sizeof(struct tdl_record) + MESSAGE_LENGTH)     ///< ... with its header
+#define  TDL_ARENA_MIN (sizeof(struct tdl_chunk) + ALIGN(TDL_RECORD_MAX, 8))  ///< Smallest chunk
+#define  TDL_SPIN_LOOPS 1000        ///< Times lock_policy=spin retries a lock before sleeping
+#define  TDL_PAGE_ORDERS 6          ///< Page block orders cached, enough for SPILL_BATCH + header
+#define  TDL_PAGE_CACHE_MAX 64      ///< Upper limit for the page_cache parameter
 
-// Drivers have a class name and a device name. "tdl" is used as the class name, and "tdlchar" as the
-// device name. This results in the creation of a device that appears on the file system at
-// /dev/tdlchar in the device tree and at /sys/class/tdl/tdlchar in the sysfs virtual file system.
-static struct class*  tdlcharClass  = NULL; ///< The device-driver class struct pointer
-static struct device* tdlcharDevice = NULL; ///< The device-driver device struct pointer
+#define  TDL_HIST_BUCKETS 32        ///< log2 buckets of lock wait and hold times in ns, up to ~1 s
+#define  TDL_TOP_HOLDERS  8         ///< Number of longest lock holds kept for debugfs
+#define  TDL_SLOW_RING    64        ///< Number of slow operations kept, a power of two
+#define  TDL_PEEK_PREFIX  16        ///< Bytes of each record shown in debugfs records
+#define  TDL_RING_MAX     4096      ///< Upper limit for the ring_slots parameter
 
-static DEFINE_MUTEX(tdlchar_mutex);     ///< Macro to declare a new mutex
+static atomic_t numberOpens = ATOMIC_INIT(0); ///< Counts the number of times the device is opened
 
-// The prototype functions for the character driver -- must come before the struct definition
-static int     dev_open(struct inode *, struct file *);
-static int     dev_release(struct inode *, struct file *);
-static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
-static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+/** @brief Wait and hold times of a lock, or of a class of short-lived locks such as the groups' */
+struct tdl_lock_stats
+{
+   char       name[24];                     ///< Name shown in debugfs
+   atomic64_t acquired;                     ///< Number of times the lock was taken
+   atomic64_t contended;                    ///< ... of which the trylock fast path failed
+   atomic64_t wait_ns;                      ///< Total time spent waiting for the lock
+   atomic64_t hold_ns;                      ///< Total time the lock was held
+   atomic64_t wait_max;                     ///< Longest wait
+   atomic64_t hold_max;                     ///< Longest hold
+   atomic64_t wait_hist[TDL_HIST_BUCKETS];  ///< Waits by log2 of their length in ns
+   atomic64_t hold_hist[TDL_HIST_BUCKETS];  ///< Holds by log2 of their length in ns
+};
 
-/** @brief Devices are represented as file structure in the kernel. The file_operations structure from
- *  /linux/fs.h lists the callback functions that you wish to associated with your file operations
- *  using a C99 syntax structure. char devices usually implement open, read, write and release calls
+/** @brief A mutex that accounts how long it is waited for and held */
+struct tdl_lock
+{
+   struct mutex           mutex;
+   struct tdl_lock_stats *stats;            ///< Where the times are added up
+   u64                    since;            ///< When the holder took the lock, 0 if not timed
+};
+
+/** @brief The operations whose latency is watched -- the values are used by the tracepoint */
+enum tdl_op
+{
+   TDL_OP_READ,
+   TDL_OP_WRITE,
+};
+
+/** @brief Where the time of an operation went */
+enum tdl_phase
+{
+   TDL_PHASE_WAIT,                          ///< Waiting for locks, records or queue space
+   TDL_PHASE_COPY,                          ///< Copying to or from user space, converting
+   TDL_PHASE_QUEUE,                         ///< Queue work: enqueue, spill, refill, trim
+   TDL_PHASES
+};
+
+/** @brief Times the phases of one read or write.  Lives on the caller's stack. */
+struct tdl_op_timer
+{
+   u64  start;                              ///< When the operation started
+   u64  mark;                               ///< When the current phase started, 0 if not timed
+   u64  phase_ns[TDL_PHASES];
+};
+
+/** @brief A read or write that took longer than its threshold */
+struct tdl_slow_op
+{
+   u64    ticket;                           ///< Position in the ring, 0 while being written
+   u64    when_ns;                          ///< ktime_get_ns() at the end of the operation
+   u64    total_ns;
+   u64    phase_ns[TDL_PHASES];
+   size_t size;                             ///< Bytes read or written
+   pid_t  pid;
+   char   comm[TASK_COMM_LEN];
+   int    op;                               ///< enum tdl_op
+};
+
+/** @brief Free record buffers allocated when the module was loaded, for one NUMA node */
+struct tdl_pool
+{
+   spinlock_t       lock;
+   struct list_head free;                   ///< Free buffers, linked through tdl_record.node
+   unsigned int     count;                  ///< Number of buffers in free
+};
+
+/** @brief A record queued by tdlchar_enqueue(), waiting in its CPU's ring.  256 bytes. */
+struct tdl_ring_slot
+{
+   u32  len;                                ///< Bytes in data
+   u32  hash;                               ///< Picks the partition, as tdl_write_partition()
+   char data[TDLCHAR_ENQUEUE_MAX];
+};
+
+/** @brief One CPU's ring of records for tdlchar_enqueue().  Only that CPU adds records, with
+ *  interrupts off, and only tdl_ring_drain() takes them out, so head and tail need no lock: each
+ *  has one writer, and the release and acquire on them order the slot contents.
  */
-static struct file_operations fops =
+struct tdl_ring
 {
-   .open = dev_open,       // Called each time the device is opened from user space
-   .read = dev_read,       // Called when data is sent from the device to user space
-   .write = dev_write,     // Called when data is sent from user space to the device
-   .release = dev_release, // Called when the device is closed in user space
+   unsigned int          head;              ///< Slots ever filled, written by the producer
+   unsigned int          tail;              ///< Slots ever emptied, written by tdl_ring_drain()
+   struct tdl_ring_slot *slots;             ///< ring_slots of them, on the CPU's node
 };
 
-/** @brief The LKM initialization function
- *  The static keyword restricts the visibility of the function to within this C file. The __init
- *  macro means that for a built-in driver (not a LKM) the function is only used at initialization
- *  time and that it can be discarded and its memory freed up after that point.
- *  @return returns 0 if successful
+/** @brief Freed page blocks of large records, kept by a CPU for the next large record.  The lock
+ *  is only contended when the shrinker empties the cache from another CPU.
  */
-static int __init tdlchar_init(void)
+struct tdl_page_cache
+{
+   spinlock_t   lock;
+   unsigned int count[TDL_PAGE_ORDERS];     ///< Blocks cached per order
+   struct page *pages[];                    ///< page_cache blocks per order, see tdl_page_slots()
+};
+
+/** @brief One of the longest lock holds seen, and who held the lock */
+struct tdl_holder
 {
-   printk(KERN_INFO "TDLChar: Initializing the TDLChar LKM\n");
+   u64   held_ns;
+   pid_t pid;
+   char  comm[TASK_COMM_LEN];
+   char  lock[24];                          ///< Name from the lock's statistics
+};
 
-   // Try to dynamically allocate a major number for the device -- more difficult but worth it
-   majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
-   if (majorNumber<0)
-   {
-      printk(KERN_ALERT "TDLChar failed to register a major number\n");
-      return majorNumber;
-   }
-   printk(KERN_INFO "TDLChar: registered correctly with major number %d\n", majorNumber);
+/** @brief A message written to the device, already converted and waiting to be read.  A spilled
+ *  record is a stub without data[] that remembers where in the spill file its bytes went.
+ */
+struct tdl_record
+{
+   struct list_head node;                   ///< Link in the partition's list of records
+   u64              seq;                    ///< Position of the record in its partition
+   u64              off;                    ///< Bytes queued in the partition before it
+   size_t           len;                    ///< Number of bytes in data[]
+   bool             spilled;                ///< The data is in the spill file, not in data[]
+   bool             refilled;               ///< Read back from the spill file -- never spill again
+   s16              pool_node;              ///< Pool the buffer goes back to, -1 if not pooled
+   s8               page_order;             ///< Order of the page block it is in, -1 if none
+   struct tdl_chunk *chunk;                 ///< Arena chunk it was carved from, NULL if none
+   struct list_head spill_node;             ///< Link in the partition's spilled list, oldest first
+   loff_t           spill_off;              ///< Offset of the data in the spill file
+   char             data[];                 ///< The converted message
+};
 
-   // Register the device class
-   tdlcharClass = class_create(THIS_MODULE, CLASS_NAME);
+struct tdl_group;
+struct tdl_session;
 
-   // Check for error and clean up if there is
-   if (IS_ERR(tdlcharClass))
-   {
-      unregister_chrdev(majorNumber, DEVICE_NAME);
-      printk(KERN_ALERT "Failed to register device class\n");
-      return PTR_ERR(tdlcharClass);          // Correct way to return an error on a pointer
-   }
-   printk(KERN_INFO "TDLChar: device class registered correctly\n");
+/** @brief A block that a partition's records are carved from in arena mode.  Records are
+ *  allocated by bumping used, and the whole chunk is freed once none of them are left.
+ */
+struct tdl_chunk
+{
+   unsigned int live;                       ///< Records in the chunk, +1 while it is current
+   size_t       used;                       ///< Bytes of data[] handed out
+   char         data[];
+};
 
-   // Register the device driver, hard-code minor number of zero
-   tdlcharDevice = device_create(tdlcharClass, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
+/** @brief A consumer group's read position in one partition, and which member owns it.  The
+ *  position is protected by the partition lock; ownership changes need both the group lock and
+ *  the partition lock.
+ */
+struct tdl_cursor
+{
+   struct list_head    node;                ///< Link in the partition's list of cursors
+   struct tdl_group   *group;               ///< The group this cursor belongs to
+   struct tdl_record  *next;                ///< Next record to read, NULL when caught up
+   u64                 seq;                 ///< Sequence number of that record
+   size_t              pos;                 ///< Bytes of it already read by a short read
+   u64                 off;                 ///< Bytes of the partition read, i.e. next->off + pos
+   struct tdl_session *owner;               ///< Member reading this partition, NULL if none
+   bool                pinned;              ///< The owner pinned it with TDLCHAR_IOC_BIND
+};
 
-   // Clean up if there is an error
-   if (IS_ERR(tdlcharDevice))
-   {
-      class_destroy(tdlcharClass);           // Repeated code but the alternative is goto statements
-      unregister_chrdev(majorNumber, DEVICE_NAME);
-      printk(KERN_ALERT "Failed to create the device\n");
-      return PTR_ERR(tdlcharDevice);
-   }
-   printk(KERN_INFO "TDLChar: device class created correctly\n"); // Made it! device was initialized
+/** @brief A FIFO of records.  Records written with the same key always land in the same
+ *  partition, so they are read back in the order they were written.  A record stays queued until
+ *  every group's cursor has moved past it.
+ */
+struct tdl_partition
+{
+   struct tdl_lock   lock;                  ///< Protects the records, cursors, depth and next_seq
+   struct tdl_lock_stats lock_stats;        ///< Wait and hold times of lock
+   struct list_head  records;               ///< Queued records, oldest first
+   struct list_head  cursors;               ///< One cursor per consumer group
+   unsigned int      depth;                 ///< Number of records queued
+   u64               next_seq;              ///< Sequence number for the next record written
+   u64               next_off;              ///< Bytes ever queued, the off of the next record
+   wait_queue_head_t writeq;                ///< Writers wait here when the partition is full
+   size_t            mem_bytes;             ///< Bytes of record data held in memory
+   size_t            spill_bytes;           ///< Bytes of record data held in the spill file
+   struct file      *spill_file;            ///< shmem file for spilled records, made on first use
+   struct list_head  spilled;               ///< Spilled record stubs, in spill file order
+   loff_t            spill_tail;            ///< Where the next spilled batch is written
+   loff_t            spill_punched;         ///< Spill file space below this has been given back
+   spinlock_t        arena_lock;            ///< Protects arena and the chunks' live counts
+   struct tdl_chunk *arena;                 ///< Chunk new records are carved from
+   atomic64_t        alloc_bytes;           ///< Bytes allocated for this partition's records
+   atomic64_t        alloc_peak;            ///< High-water mark of alloc_bytes
+   struct tdlchar_shm_part *shm;            ///< Its counters in the statistics pages
+};
 
-   // Initialize the mutex dynamically
-   mutex_init(&tdlchar_mutex);
+/** @brief A named set of readers that share the work of reading every record once */
+struct tdl_group
+{
+   struct list_head  node;                  ///< Link in tdl_groups
+   char              name[TDLCHAR_GROUP_MAX];
+   struct tdl_lock   lock;                  ///< Protects members and partition ownership
+   struct list_head  members;               ///< The sessions in this group
+   unsigned int      nmembers;
+   wait_queue_head_t readq;                 ///< Members wait here for records
+   struct tdl_cursor cursors[];             ///< One per partition
+};
 
-   return 0;
-}
+/** @brief The per-open state, kept in filep->private_data */
+struct tdl_session
+{
+   bool              has_key;               ///< A key was set with TDLCHAR_IOC_SET_KEY
+   u32               key_hash;              ///< Hash of that key
+   struct tdl_lock   lock;                  ///< Serializes joining a group
+   struct tdl_group *group;                 ///< Group joined, NULL until the first read or join
+   struct list_head  member;                ///< Link in the group's member list
+   int               bound;                 ///< Partition pinned with TDLCHAR_IOC_BIND, -1 for none
+   unsigned int      owned;                 ///< Partitions this member owns (group lock)
+   unsigned int      cursor;                ///< Partition this member last read from
+   struct rcu_head   rcu;                   ///< Sessions are freed after a grace period
+   atomic64_t        bytes_in;              ///< Statistics for TDLCHAR_IOC_GET_STATS ...
+   atomic64_t        bytes_out;
+   atomic64_t        writes;
+   atomic64_t        reads;
+   atomic64_t        blocked_ns;
+   atomic64_t        dropped;
+   atomic64_t        xform_calls;
+   atomic64_t        xform_bytes;
+};
 
-/** @brief The LKM cleanup function
- *  Similar to the initialization function, it is static. The __exit macro notifies that if this
- *  code is used for a built-in driver (not a LKM) that this function is not required.
- */
-static void __exit tdlchar_exit(void)
+static struct tdl_partition *tdl_parts;     ///< The partition queues, partitions entries long
+static struct tdlchar_shm *tdl_shm;         ///< The statistics pages user space can mmap()
+static size_t tdl_shm_size;                 ///< Their size, a whole number of pages
+static LIST_HEAD(tdl_groups);               ///< All consumer groups with at least one member
+
+static struct tdl_lock_stats tdl_groups_lock_stats = { .name = "groups" };
+static struct tdl_lock_stats tdl_group_lock_stats = { .name = "group" };     ///< All groups' locks
+static struct tdl_lock_stats tdl_session_lock_stats = { .name = "session" }; ///< All sessions
+
+/** @brief Protects tdl_groups and group lifetimes */
+static struct tdl_lock tdl_groups_lock =
 {
-   mutex_destroy(&tdlchar_mutex);                           // destroy the dynamically-allocated mutex
-   device_destroy(tdlcharClass, MKDEV(majorNumber, 0));     // remove the device
-   class_unregister(tdlcharClass);                          // unregister the device class
-   class_destroy(tdlcharClass);                             // remove the device class
-   unregister_chrdev(majorNumber, DEVICE_NAME);             // unregister the major number
-   printk(KERN_INFO "TDLChar: Goodbye from the LKM!\n");
-}
+   .mutex = __MUTEX_INITIALIZER(tdl_groups_lock.mutex),
+   .stats = &tdl_groups_lock_stats,
+};
 
-/** @brief The device open function that is called each time the device is opened
- *  This will only increment the numberOpens counter in this case.
- *  @param inodep A pointer to an inode object (defined in linux/fs.h)
- *  @param filep A pointer to a file object (defined in linux/fs.h)
+static struct tdl_holder tdl_holders[TDL_TOP_HOLDERS];  ///< The longest lock holds seen
+static DEFINE_SPINLOCK(tdl_holders_lock);               ///< Protects tdl_holders
+static u64 tdl_holders_min;                             ///< Shortest hold in tdl_holders
+static struct dentry *tdl_debugfs;                      ///< /sys/kernel/debug/tdlchar
+
+static struct tdl_slow_op tdl_slow_ring[TDL_SLOW_RING]; ///< The latest slow operations
+static atomic64_t tdl_slow_next = ATOMIC64_INIT(0);     ///< Ticket of the latest one
+
+static atomic64_t tdl_alloc_bytes = ATOMIC64_INIT(0);    ///< Bytes allocated for records
+static atomic64_t tdl_alloc_peak = ATOMIC64_INIT(0);     ///< High-water mark of tdl_alloc_bytes
+static struct tdl_pool *tdl_pools;                       ///< One per node id, NULL without a pool
+static size_t tdl_pool_buf_size;                         ///< Size of each pool buffer
+static atomic64_t tdl_pool_hits = ATOMIC64_INIT(0);      ///< Records that got a pool buffer
+static atomic64_t tdl_pool_misses = ATOMIC64_INIT(0);    ///< Records that found the pool empty
+static struct tdl_page_cache __percpu *tdl_page_caches;  ///< Recycled record pages, or NULL
+static atomic64_t tdl_page_hits = ATOMIC64_INIT(0);      ///< Large records that reused a block
+static atomic64_t tdl_page_misses = ATOMIC64_INIT(0);    ///< ... that went to the page allocator
+static atomic64_t tdl_page_releases = ATOMIC64_INIT(0);  ///< Blocks given back to the allocator
+static atomic64_t tdl_page_pipe_held = ATOMIC64_INIT(0); ///< ... or left to a pipe to free
+static atomic64_t tdl_spilled_total = ATOMIC64_INIT(0);  ///< Bytes ever written to spill files
+static atomic64_t tdl_refilled_total = ATOMIC64_INIT(0); ///< Bytes ever read back from them
+static DEFINE_PER_CPU(struct tdl_ring, tdl_rings);       ///< tdlchar_enqueue()'s records
+static atomic64_t tdl_ring_queued = ATOMIC64_INIT(0);    ///< ... that made it to a partition
+static atomic64_t tdl_ring_dropped = ATOMIC64_INIT(0);   ///< ... that didn't, ring or queue full
+static struct tdl_session tdl_ring_session;              ///< Writes them, for the statistics
+
+static void tdl_ring_kick(struct irq_work *work);
+static void tdl_ring_drain(struct work_struct *work);
+static DEFINE_IRQ_WORK(tdl_ring_irq_work, tdl_ring_kick);      ///< Runs tdl_ring_kick()
+static DECLARE_WORK(tdl_ring_work, tdl_ring_drain);             ///< Runs tdl_ring_drain()
+
+// Tunables that can be changed while the device is in use, through
+// /sys/module/tdlchar/parameters/.  Their setters validate the new value and bring the running
+// device in line with it.  Until tdlchar_init() has published tdl_parts only the value is checked;
+// tdlchar_init() then checks the combination.  Writes through sysfs hold kernel_param_lock(),
+// which tdlchar_exit() takes before tearing the partitions down.
+
+/** @brief The transforms dev_write() can apply to a record */
+enum tdl_transform
+{
+   TDL_XFORM_NONE,                          ///< Pass the bytes through unchanged
+   TDL_XFORM_UPPER,                         ///< Convert a-z to upper case
+   TDL_XFORM_LOWER,                         ///< Convert A-Z to lower case
+   TDL_XFORM_CUSTOM,                        ///< A table loaded through sysfs
+};
+
+/** @brief A transform as dev_write() applies it: the output byte for every input byte.  Once
+ *  published through tdl_xform a table never changes, so writers read it under rcu_read_lock()
+ *  alone and a new one can be swapped in while they run.
  */
-static int dev_open(struct inode *inodep, struct file *filep)
+struct tdl_xform
+{
+   struct rcu_head rcu;                     ///< Frees a replaced custom table
+   int             mode;                    ///< Which enum tdl_transform built the table
+   u8              lut[256];
+};
+
+/** @brief How tdl_lock() waits for a lock another task holds */
+enum tdl_lock_policy
+{
+   TDL_LOCK_SLEEP,                          ///< Sleep on the mutex right away
+   TDL_LOCK_SPIN,                           ///< Retry for a while first, for very short holds
+};
+
+/** @brief A parameter that takes one of a fixed set of names */
+struct tdl_choice
 {
-   // Try to acquire the mutex (returns 0 on fail)
-   if(!mutex_trylock(&tdlchar_mutex))
+   int                value;                ///< Index of the current name
+   const char * const *names;
+   unsigned int       count;
+};
+
+static const char * const tdl_transform_names[] = { "none", "upper", "lower", "custom" };
+static const char * const tdl_lock_policy_names[] = { "sleep", "spin" };
+
+/** @brief Set a tdl_choice parameter by name */
+static int tdl_choice_set(const char *val, const struct kernel_param *kp)
+{
+   struct tdl_choice *choice = kp->arg;
+   int i = __sysfs_match_string(choice->names, choice->count, val);
+
+   if (i < 0)
    {
-      printk(KERN_ALERT "TDLChar: Device in use by another process");
-      return -EBUSY;
+      return i;
    }
-
-   numberOpens++;
-   printk(KERN_INFO "TDLChar: Device has been opened %d time(s)\n", numberOpens);
+   WRITE_ONCE(choice->value, i);
    return 0;
 }
 
-/** @brief This function is called whenever device is being read from user space i.e. data is
- *  being sent from the device to the user. In this case is uses the copy_to_user() function to
- *  send the buffer string to the user and captures any errors.
- *  @param filep A pointer to a file object (defined in linux/fs.h)
- *  @param buffer The pointer to the buffer to which this function writes the data
- *  @param len The length of the b
- *  @param offset The offset if required
- */
-static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
+/** @brief Show the name a tdl_choice parameter is set to */
+static int tdl_choice_get(char *buf, const struct kernel_param *kp)
 {
-   int error_count = 0;
-   // copy_to_user has the format ( * to, *from, size) and returns 0 on success
-   error_count = copy_to_user(buffer, message, size_of_message);
+   const struct tdl_choice *choice = kp->arg;
 
-   // if true then have success
-   if (error_count==0)
-   {
-      printk(KERN_INFO "TDLChar: Sent %d characters to the user\n", size_of_message);
-      return (size_of_message=0);  // clear the position to the start and return 0
-   }
-   else
-   {
-      printk(KERN_INFO "TDLChar: Failed to send %d characters to the user\n", error_count);
-      return -EFAULT;              // Failed -- return a bad address message (i.e. -14)
-   }
+   return scnprintf(buf, PAGE_SIZE, "%s\n", choice->names[READ_ONCE(choice->value)]);
 }
 
+static const struct kernel_param_ops tdl_choice_ops =
+{
+   .set = tdl_choice_set,
+   .get = tdl_choice_get,
+};
+
 /** @brief Convert a character to upper case
  * Straight forward implementation of toupper() in C since not available in kernel libs
  * @param inChar A character
@@ -195,39 +538,3622 @@ static char toupper(const char inChar)
    return outChar;
 }
 
-/** @brief This function is called whenever the device is being written to from user space i.e.
- *  data is sent to the device from the user. The data is copied to the message[] array in this
- *  LKM but it is converted to all uppercase first.
- *  @param filep A pointer to a file object
- *  @param buffer The buffer to that contains the string to write to the device
- *  @param len The length of the array of data that is being passed in the const char buffer
- *  @param offset The offset if required
+/** @brief Convert a character to lower case, the counterpart of toupper()
+ * @param inChar A character
+ * @return returns the lower-case version of the input character
  */
-static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset)
+static char tolower(const char inChar)
+{
+   char outChar = inChar;
+   if (inChar >= 'A' && inChar <= 'Z')
+   {
+      outChar = inChar + ('a' - 'A');
+   }
+   return outChar;
+}
+
+// The built-in tables are filled in by tdlchar_init(); custom ones are allocated per load
+static struct tdl_xform tdl_xforms[TDL_XFORM_CUSTOM];
+static struct tdl_xform __rcu *tdl_xform = RCU_INITIALIZER(&tdl_xforms[TDL_XFORM_UPPER]);
+
+/** @brief Make xf the table that dev_write() applies from now on
+ *  Writers that already hold the old table finish with it; a custom one is freed once they have.
+ */
+static void tdl_xform_publish(struct tdl_xform *xf)
+{
+   struct tdl_xform *old = unrcu_pointer(xchg(&tdl_xform, RCU_INITIALIZER(xf)));
+
+   if (old->mode == TDL_XFORM_CUSTOM)
+   {
+      kfree_rcu(old, rcu);
+   }
+}
+
+/** @brief Fill in the built-in transform tables */
+static void tdl_xform_build(void)
 {
    int i;
-   // Copy the buffer contents to our message buffer one byte at a time, converting to upper case
+
+   for (i = 0; i < 256; i++)
+   {
+      tdl_xforms[TDL_XFORM_NONE].lut[i] = i;
+      tdl_xforms[TDL_XFORM_UPPER].lut[i] = toupper(i);
+      tdl_xforms[TDL_XFORM_LOWER].lut[i] = tolower(i);
+   }
+   for (i = 0; i < TDL_XFORM_CUSTOM; i++)
+   {
+      tdl_xforms[i].mode = i;
+   }
+}
+
+/** @brief Replace every byte of data with its entry in a transform table */
+static void tdl_xform_apply(const u8 *lut, char *data, size_t len)
+{
+   size_t i;
+
    for( i = 0; i < len; i++)
    {
-      message[i] = toupper(buffer[i]);
+      data[i] = lut[(u8)data[i]];
    }
-   message[len] = '\0'; // ensure null terminated
-   size_of_message = strlen(message);                 // store the length of the stored message
-   printk(KERN_INFO "TDLChar: Received %zu characters from the user\n", len);
-   return len;
 }
 
-/** @brief The device release function that is called whenever the device is closed/released by
- *  the userspace program
- *  @param inodep A pointer to an inode object (defined in linux/fs.h)
- *  @param filep A pointer to a file object (defined in linux/fs.h)
+/** @brief Switch to one of the built-in transforms by name */
+static int tdl_transform_set(const char *val, const struct kernel_param *kp)
+{
+   int i = __sysfs_match_string(tdl_transform_names, TDL_XFORM_CUSTOM, val);
+
+   if (i < 0)
+   {
+      return i;
+   }
+   tdl_xform_publish(&tdl_xforms[i]);
+   return 0;
+}
+
+/** @brief Show the name of the transform in use, "custom" for a table loaded through sysfs */
+static int tdl_transform_get(char *buf, const struct kernel_param *kp)
+{
+   int mode;
+
+   rcu_read_lock();
+   mode = rcu_dereference(tdl_xform)->mode;
+   rcu_read_unlock();
+   return scnprintf(buf, PAGE_SIZE, "%s\n", tdl_transform_names[mode]);
+}
+
+static const struct kernel_param_ops tdl_transform_ops =
+{
+   .set = tdl_transform_set,
+   .get = tdl_transform_get,
+};
+module_param_cb(transform, &tdl_transform_ops, NULL, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(transform, "Transform applied to written records: none, upper or lower "
+                 "(default upper)");
+
+static struct tdl_choice lock_policy =
+{
+   .value = TDL_LOCK_SLEEP,
+   .names = tdl_lock_policy_names,
+   .count = ARRAY_SIZE(tdl_lock_policy_names),
+};
+module_param_cb(lock_policy, &tdl_choice_ops, &lock_policy, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(lock_policy, "How a task waits for a busy lock: sleep, or spin briefly before "
+                 "sleeping (default sleep)");
+
+static unsigned int queue_depth = 64;        ///< Records a partition holds before writers block
+
+/** @brief Change queue_depth.  Writers blocked on a full partition re-check against the new depth;
+ *  lowering it below a partition's backlog makes writers wait until readers catch up.
  */
-static int dev_release(struct inode *inodep, struct file *filep)
+static int tdl_set_queue_depth(const char *val, const struct kernel_param *kp)
+{
+   unsigned int depth, i;
+   int ret = kstrtouint(val, 0, &depth);
+
+   if (ret)
+   {
+      return ret;
+   }
+   if (depth < 1)
+   {
+      return -EINVAL;
+   }
+   WRITE_ONCE(queue_depth, depth);
+   for (i = 0; tdl_parts && i < partitions; i++)
+   {
+      wake_up_interruptible(&tdl_parts[i].writeq);
+   }
+   return 0;
+}
+
+static const struct kernel_param_ops tdl_queue_depth_ops =
+{
+   .set = tdl_set_queue_depth,
+   .get = param_get_uint,
+};
+module_param_cb(queue_depth, &tdl_queue_depth_ops, &queue_depth, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(queue_depth, "Maximum number of records queued per partition (default 64)");
+
+static unsigned int message_pages = 1;       ///< Largest record, in pages
+
+/** @brief Change message_pages, the largest record.  Records already queued keep their size; a
+ *  running device in arena mode refuses records that would not fit in a chunk, and one in
+ *  deterministic mode records that would not fit in a pool buffer.
+ */
+static int tdl_set_message_pages(const char *val, const struct kernel_param *kp)
+{
+   unsigned int pages;
+   int ret = kstrtouint(val, 0, &pages);
+
+   if (ret)
+   {
+      return ret;
+   }
+   if (pages < 1 || pages > SPILL_BATCH / PAGE_SIZE)
+   {
+      return -EINVAL;               // a record has to fit in one spill batch
+   }
+   if (tdl_parts && arena_chunk &&
+       arena_chunk < sizeof(struct tdl_chunk) +
+                     ALIGN(sizeof(struct tdl_record) + pages * PAGE_SIZE, 8))
+   {
+      return -EINVAL;               // the largest record has to fit in an arena chunk
+   }
+   if (tdl_parts && deterministic &&
+       sizeof(struct tdl_record) + pages * PAGE_SIZE > tdl_pool_buf_size)
+   {
+      return -EINVAL;               // ... or in a pool buffer, the only place records come from
+   }
+   WRITE_ONCE(message_pages, pages);
+   return 0;
+}
+
+static const struct kernel_param_ops tdl_message_pages_ops =
 {
-   // release the mutex (i.e., lock goes up)
-   mutex_unlock(&tdlchar_mutex);
+   .set = tdl_set_message_pages,
+   .get = param_get_uint,
+};
+module_param_cb(message_pages, &tdl_message_pages_ops, &message_pages, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(message_pages, "Largest record in pages -- a longer write is short -- up to "
+                 "64 KiB (default 1)");
+
+// Drivers have a class name and a device name. "tdl" is used as the class name, and "tdlchar" as the
+// device name. This results in the creation of a device that appears on the file system at
+// /dev/tdlchar in the device tree and at /sys/class/tdl/tdlchar in the sysfs virtual file system.
+static struct class*  tdlcharClass  = NULL; ///< The device-driver class struct pointer
+static struct device* tdlcharDevice = NULL; ///< The device-driver device struct pointer
+static u64 tdl_init_start;                  ///< ktime_get_ns() when tdlchar_init() started
+static u64 tdl_init_ns;                     ///< Time from then until the device was ready
+
+// The prototype functions for the character driver -- must come before the struct definition
+static int     dev_open(struct inode *, struct file *);
+static int     dev_release(struct inode *, struct file *);
+static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
+static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t dev_splice_read(struct file *, loff_t *, struct pipe_inode_info *, size_t,
+                               unsigned int);
+static ssize_t dev_splice_write(struct pipe_inode_info *, struct file *, loff_t *, size_t,
+                                unsigned int);
+static __poll_t dev_poll(struct file *, poll_table *);
+static int     dev_mmap(struct file *, struct vm_area_struct *);
+static long    dev_ioctl(struct file *, unsigned int, unsigned long);
+
+/** @brief Devices are represented as file structure in the kernel. The file_operations structure from
+ *  /linux/fs.h lists the callback functions that you wish to associated with your file operations
+ *  using a C99 syntax structure. char devices usually implement open, read, write and release calls
+ */
+static struct file_operations fops =
+{
+   .owner = THIS_MODULE,   // Keeps the module loaded while the device is open
+   .open = dev_open,       // Called each time the device is opened from user space
+   .read = dev_read,       // Called when data is sent from the device to user space
+   .write = dev_write,     // Called when data is sent from user space to the device
+   .splice_read = dev_splice_read,     // Called to splice() records into a pipe
+   .splice_write = dev_splice_write,   // Called to splice() a pipe's contents in as a record
+   .poll = dev_poll,       // Called by poll()/select()/epoll to check for data or space
+   .mmap = dev_mmap,       // Called to map the statistics pages
+   .unlocked_ioctl = dev_ioctl,        // Called for the TDLCHAR_IOC_* commands
+   .compat_ioctl = compat_ptr_ioctl,   // 32-bit processes pass the same structures
+   .release = dev_release, // Called when the device is closed in user space
+};
+
+/** @brief Initialize a tdl_lock.  A macro rather than a function so that, like mutex_init(), each
+ *  call site gets its own lockdep class and nesting a group lock in a session lock isn't reported
+ *  as recursive locking.
+ */
+#define tdl_lock_init(lock, lock_stats)         \
+   do                                           \
+   {                                            \
+      mutex_init(&(lock)->mutex);               \
+      (lock)->stats = (lock_stats);             \
+      (lock)->since = 0;                        \
+   } while (0)
+
+/** @brief Raise a statistics maximum to val if it is larger */
+static void tdl_stat_max(atomic64_t *max, u64 val)
+{
+   s64 old = atomic64_read(max);
+
+   while ((s64)val > old && !atomic64_try_cmpxchg(max, &old, val))
+   {
+   }
+}
+
+/** @brief Histogram bucket of a time in ns: 0 for 0 ns, otherwise b for [2^(b-1), 2^b) */
+static unsigned int tdl_hist_bucket(u64 ns)
+{
+   return min_t(unsigned int, fls64(ns), TDL_HIST_BUCKETS - 1);
+}
+
+/** @brief Remember a lock hold if it is one of the TDL_TOP_HOLDERS longest seen so far */
+static void tdl_note_holder(struct tdl_lock_stats *stats, u64 held)
+{
+   unsigned int i, min = 0;
+
+   if (held <= READ_ONCE(tdl_holders_min))
+   {
+      return;                              // the common case -- not a record-setting hold
+   }
+   spin_lock(&tdl_holders_lock);
+   for (i = 1; i < TDL_TOP_HOLDERS; i++)
+   {
+      if (tdl_holders[i].held_ns < tdl_holders[min].held_ns)
+      {
+         min = i;
+      }
+   }
+   if (held > tdl_holders[min].held_ns)
+   {
+      tdl_holders[min].held_ns = held;
+      tdl_holders[min].pid = task_pid_nr(current);
+      get_task_comm(tdl_holders[min].comm, current);
+      strscpy(tdl_holders[min].lock, stats->name, sizeof(tdl_holders[min].lock));
+
+      held = tdl_holders[0].held_ns;
+      for (i = 1; i < TDL_TOP_HOLDERS; i++)
+      {
+         held = min(held, tdl_holders[i].held_ns);
+      }
+      WRITE_ONCE(tdl_holders_min, held);
+   }
+   spin_unlock(&tdl_holders_lock);
+}
+
+/** @brief Try to take a lock without sleeping.  Under lock_policy=spin keep trying for a while,
+ *  which beats going to sleep when the lock is only ever held for a few microseconds.  Not in
+ *  deterministic mode: a real-time task spinning on a lock whose holder it has preempted only
+ *  delays it, where sleeping on the mutex lends the holder its priority under PREEMPT_RT.
+ *  @return true if the lock was taken
+ */
+static bool tdl_lock_fast(struct tdl_lock *lock)
+{
+   unsigned int i;
+
+   if (mutex_trylock(&lock->mutex))
+   {
+      return true;
+   }
+   if (READ_ONCE(lock_policy.value) != TDL_LOCK_SPIN || deterministic)
+   {
+      return false;
+   }
+   for (i = 0; i < TDL_SPIN_LOOPS; i++)
+   {
+      cpu_relax();
+      if (!mutex_is_locked(&lock->mutex) && mutex_trylock(&lock->mutex))
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+/** @brief Take a lock, accounting the time spent waiting for it */
+static void tdl_lock(struct tdl_lock *lock)
+{
+   struct tdl_lock_stats *stats = lock->stats;
+   u64 start, wait = 0;
+
+   if (!READ_ONCE(lock_profile))
+   {
+      if (!tdl_lock_fast(lock))
+      {
+         mutex_lock(&lock->mutex);
+      }
+      lock->since = 0;
+      return;
+   }
+   start = ktime_get_ns();
+   if (tdl_lock_fast(lock))
+   {
+      lock->since = start;
+   }
+   else
+   {
+      mutex_lock(&lock->mutex);
+      lock->since = ktime_get_ns();
+      wait = lock->since - start;
+      atomic64_inc(&stats->contended);
+   }
+   atomic64_inc(&stats->acquired);
+   atomic64_add(wait, &stats->wait_ns);
+   atomic64_inc(&stats->wait_hist[tdl_hist_bucket(wait)]);
+   tdl_stat_max(&stats->wait_max, wait);
+}
+
+/** @brief Release a lock, accounting how long it was held and by whom */
+static void tdl_unlock(struct tdl_lock *lock)
+{
+   struct tdl_lock_stats *stats = lock->stats;
+   u64 held;
+
+   if (lock->since)
+   {
+      held = ktime_get_ns() - lock->since;
+      lock->since = 0;
+      atomic64_add(held, &stats->hold_ns);
+      atomic64_inc(&stats->hold_hist[tdl_hist_bucket(held)]);
+      tdl_stat_max(&stats->hold_max, held);
+      tdl_note_holder(stats, held);
+   }
+   mutex_unlock(&lock->mutex);
+}
+
+/** @brief The slow threshold of an operation in microseconds, 0 if not watched */
+static unsigned int tdl_slow_threshold(enum tdl_op op)
+{
+   return op == TDL_OP_READ ? READ_ONCE(slow_read_us) : READ_ONCE(slow_write_us);
+}
+
+/** @brief Start timing an operation.  Every operation counts in the latency histograms of the
+ *  statistics pages; its phases are only timed if a slow threshold is set for it.
+ */
+static void tdl_timer_start(struct tdl_op_timer *timer, enum tdl_op op)
+{
+   unsigned int threshold = tdl_slow_threshold(op);
+
+   memset(timer, 0, sizeof(*timer));
+   timer->start = ktime_get_ns();
+   if (threshold)
+   {
+      timer->mark = timer->start;
+   }
+}
+
+/** @brief Charge the time since the last mark to a phase */
+static void tdl_timer_phase(struct tdl_op_timer *timer, enum tdl_phase phase)
+{
+   u64 now;
+
+   if (!timer->mark)
+   {
+      return;
+   }
+   now = ktime_get_ns();
+   timer->phase_ns[phase] += now - timer->mark;
+   timer->mark = now;
+}
+
+/** @brief Finish timing an operation, charging the rest to the given phase, and count it in the
+ *  latency histogram of the statistics pages.  If it took longer than its threshold, fire the
+ *  tracepoint and put it in the slow operations ring.
+ *  Writers claim a slot by ticket and clear the slot's ticket while they fill it in, so a reader
+ *  that sees the same non-zero ticket before and after copying an entry got a whole one.
+ */
+static void tdl_timer_end(struct tdl_op_timer *timer, enum tdl_op op, enum tdl_phase phase,
+                          size_t size)
+{
+   unsigned int threshold = tdl_slow_threshold(op);
+   struct tdl_slow_op *slow;
+   u64 *hist = op == TDL_OP_READ ? tdl_shm->read_ns : tdl_shm->write_ns;
+   u64 total, ticket;
+
+   tdl_timer_phase(timer, phase);
+   total = (timer->mark ?: ktime_get_ns()) - timer->start;
+   atomic64_inc((atomic64_t *)&hist[total ? min(ilog2(total), TDLCHAR_SHM_BUCKETS - 1) : 0]);
+   if (!timer->mark || !threshold)
+   {
+      return;
+   }
+   if (total <= (u64)threshold * NSEC_PER_USEC)
+   {
+      return;
+   }
+
+   trace_tdlchar_slow_op(op, size, total, timer->phase_ns[TDL_PHASE_WAIT],
+                         timer->phase_ns[TDL_PHASE_COPY], timer->phase_ns[TDL_PHASE_QUEUE]);
+
+   ticket = atomic64_inc_return(&tdl_slow_next);
+   slow = &tdl_slow_ring[ticket & (TDL_SLOW_RING - 1)];
+   WRITE_ONCE(slow->ticket, 0);
+   smp_wmb();
+   slow->when_ns = timer->mark;
+   slow->total_ns = total;
+   memcpy(slow->phase_ns, timer->phase_ns, sizeof(slow->phase_ns));
+   slow->size = size;
+   slow->pid = task_pid_nr(current);
+   get_task_comm(slow->comm, current);
+   slow->op = op;
+   smp_wmb();
+   WRITE_ONCE(slow->ticket, ticket);
+}
+
+/** @brief Fill the buffer pool.  The pool only saves time, so running short of memory here just
+ *  leaves it smaller than asked for.
+ */
+static void tdl_pool_init(void)
+{
+   struct tdl_record *rec;
+   unsigned int i;
+   int node, home = 0;
+
+   if (!pool_buffers)
+   {
+      return;
+   }
+   tdl_pool_buf_size = TDL_RECORD_MAX;     // records that outgrow it later skip the pool
+   tdl_pools = kcalloc(nr_node_ids, sizeof(*tdl_pools), GFP_KERNEL);
+   if (!tdl_pools)
+   {
+      printk(KERN_WARNING "TDLChar: failed to allocate the buffer pool\n");
+      return;
+   }
+   for (node = 0; node < nr_node_ids; node++)
+   {
+      spin_lock_init(&tdl_pools[node].lock);
+      INIT_LIST_HEAD(&tdl_pools[node].free);
+   }
+
+   if (pool_numa)
+   {
+      home = first_node(node_states[N_MEMORY]);
+   }
+   for (i = 0; i < pool_buffers; i++)
+   {
+      // Not charged to a cgroup: the pool belongs to the module, not to whoever loaded it
+      rec = kmalloc_node(tdl_pool_buf_size, GFP_KERNEL, pool_numa ? home : NUMA_NO_NODE);
+      if (!rec)
+      {
+         printk(KERN_WARNING "TDLChar: only %u of %u pool buffers could be allocated\n", i,
+                pool_buffers);
+         break;
+      }
+      rec->pool_node = home;
+      list_add(&rec->node, &tdl_pools[home].free);
+      tdl_pools[home].count++;
+      if (pool_numa)
+      {
+         home = next_node_in(home, node_states[N_MEMORY]);
+      }
+   }
+}
+
+/** @brief Free the buffer pool once every record has been returned to it */
+static void tdl_pool_free(void)
+{
+   struct tdl_record *rec, *tmp;
+   int node;
+
+   if (!tdl_pools)
+   {
+      return;
+   }
+   for (node = 0; node < nr_node_ids; node++)
+   {
+      list_for_each_entry_safe(rec, tmp, &tdl_pools[node].free, node)
+      {
+         kfree(rec);
+      }
+   }
+   kfree(tdl_pools);
+   tdl_pools = NULL;
+}
+
+/** @brief Take a buffer from the pool of the calling CPU's node
+ *  @return the buffer, or NULL if there is no pool or it is empty
+ */
+static struct tdl_record *tdl_pool_get(void)
+{
+   struct tdl_pool *pool;
+   struct tdl_record *rec;
+
+   if (!tdl_pools)
+   {
+      return NULL;
+   }
+   pool = &tdl_pools[pool_numa ? numa_node_id() : 0];
+   spin_lock(&pool->lock);
+   rec = list_first_entry_or_null(&pool->free, struct tdl_record, node);
+   if (rec)
+   {
+      list_del(&rec->node);
+      pool->count--;
+   }
+   spin_unlock(&pool->lock);
+   atomic64_inc(rec ? &tdl_pool_hits : &tdl_pool_misses);
+   return rec;
+}
+
+/** @brief Give a buffer back to the pool it came from */
+static void tdl_pool_put(struct tdl_record *rec)
+{
+   struct tdl_pool *pool = &tdl_pools[rec->pool_node];
+
+   spin_lock(&pool->lock);
+   list_add(&rec->node, &pool->free);     // LIFO, the next writer gets a cache-warm buffer
+   pool->count++;
+   spin_unlock(&pool->lock);
+}
+
+/** @brief The slots of a cache for blocks of the given order */
+static struct page **tdl_page_slots(struct tdl_page_cache *cache, unsigned int order)
+{
+   return &cache->pages[order * page_cache];
+}
+
+/** @brief Take a page block of the given order from this CPU's cache, or from the page allocator
+ *  Recycled blocks stay charged to the cgroup that first allocated them.
+ *  @return the block, or NULL
+ */
+static struct page *tdl_pages_get(unsigned int order)
+{
+   struct tdl_page_cache *cache = raw_cpu_ptr(tdl_page_caches);   // any CPU's will do if we move
+   struct page *page = NULL;
+
+   spin_lock(&cache->lock);
+   if (cache->count[order])
+   {
+      page = tdl_page_slots(cache, order)[--cache->count[order]];
+   }
+   spin_unlock(&cache->lock);
+   if (page)
+   {
+      atomic64_inc(&tdl_page_hits);
+      return page;
+   }
+   atomic64_inc(&tdl_page_misses);
+   return alloc_pages(GFP_KERNEL_ACCOUNT | __GFP_COMP, order);
+}
+
+/** @brief Keep a freed page block in this CPU's cache, or free it if the cache is full
+ *  A block that a pipe still has pages of (see tdl_splice_to_pipe()) is left to the pipe, which
+ *  frees it when it drops its last reference.  Blocks are compound pages so that this works.
+ */
+static void tdl_pages_put(struct page *page, unsigned int order)
+{
+   struct tdl_page_cache *cache = raw_cpu_ptr(tdl_page_caches);
+   bool cached = false;
+
+   if (page_count(page) > 1)
+   {
+      atomic64_inc(&tdl_page_pipe_held);
+      put_page(page);
+      return;
+   }
+   spin_lock(&cache->lock);
+   if (cache->count[order] < page_cache)
+   {
+      tdl_page_slots(cache, order)[cache->count[order]++] = page;
+      cached = true;
+   }
+   spin_unlock(&cache->lock);
+   if (!cached)
+   {
+      atomic64_inc(&tdl_page_releases);
+      __free_pages(page, order);
+   }
+}
+
+/** @brief Give up to nr pages from the per-CPU caches back to the page allocator
+ *  @return the number of pages freed
+ */
+static unsigned long tdl_pages_drain(unsigned long nr)
+{
+   struct tdl_page_cache *cache;
+   unsigned long freed = 0;
+   struct page *page;
+   unsigned int order;
+   int cpu;
+
+   if (!tdl_page_caches)
+   {
+      return 0;
+   }
+   for_each_possible_cpu(cpu)
+   {
+      cache = per_cpu_ptr(tdl_page_caches, cpu);
+      spin_lock(&cache->lock);
+      for (order = 0; order < TDL_PAGE_ORDERS && freed < nr; order++)
+      {
+         while (cache->count[order] && freed < nr)
+         {
+            page = tdl_page_slots(cache, order)[--cache->count[order]];
+            __free_pages(page, order);
+            atomic64_inc(&tdl_page_releases);
+            freed += 1UL << order;
+         }
+      }
+      spin_unlock(&cache->lock);
+   }
+   return freed;
+}
+
+/** @brief Tell the shrinker how many pages the caches hold */
+static unsigned long tdl_pages_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+   unsigned long total = 0;
+   unsigned int order;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+   {
+      for (order = 0; order < TDL_PAGE_ORDERS; order++)
+      {
+         total += (unsigned long)READ_ONCE(per_cpu_ptr(tdl_page_caches, cpu)->count[order])
+                  << order;
+      }
+   }
+   return total ? total : SHRINK_EMPTY;
+}
+
+/** @brief Free cached pages when the kernel is short of memory */
+static unsigned long tdl_pages_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+   return tdl_pages_drain(sc->nr_to_scan);
+}
+
+static bool tdl_pages_registered;           ///< tdl_pages_shrinker is registered
+
+static struct shrinker tdl_pages_shrinker =
+{
+   .count_objects = tdl_pages_count,
+   .scan_objects  = tdl_pages_scan,
+   .seeks         = DEFAULT_SEEKS,
+};
+
+/** @brief Allocate the per-CPU page caches, sized from page_cache, and register their shrinker.
+ *  The caches are only an optimization, so a failure costs a warning and turns them off.
+ */
+static void tdl_pages_init(void)
+{
+   struct tdl_page_cache *cache;
+   int cpu;
+
+   if (!page_cache)
+   {
+      return;
+   }
+   // Dynamic per-CPU memory, not DEFINE_PER_CPU: the module's static per-CPU area is small
+   tdl_page_caches = __alloc_percpu(struct_size(cache, pages, TDL_PAGE_ORDERS * page_cache),
+                                    __alignof__(struct tdl_page_cache));
+   if (!tdl_page_caches)
+   {
+      printk(KERN_WARNING "TDLChar: failed to allocate the page caches\n");
+      page_cache = 0;
+      return;
+   }
+   for_each_possible_cpu(cpu)
+   {
+      spin_lock_init(&per_cpu_ptr(tdl_page_caches, cpu)->lock);
+   }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+   if (register_shrinker(&tdl_pages_shrinker, "tdlchar-pages"))
+#else
+   if (register_shrinker(&tdl_pages_shrinker))
+#endif
+   {
+      printk(KERN_WARNING "TDLChar: failed to register the page cache shrinker\n");
+      free_percpu(tdl_page_caches);
+      tdl_page_caches = NULL;
+      page_cache = 0;
+      return;
+   }
+   tdl_pages_registered = true;
+}
+
+/** @brief Unregister the shrinker, free every cached page and then the caches */
+static void tdl_pages_free(void)
+{
+   if (tdl_pages_registered)
+   {
+      unregister_shrinker(&tdl_pages_shrinker);
+      tdl_pages_registered = false;
+   }
+   tdl_pages_drain(ULONG_MAX);
+   free_percpu(tdl_page_caches);
+   tdl_page_caches = NULL;
+}
+
+/** @brief Allocate each CPU's ring for tdlchar_enqueue(), if ring_slots asks for them
+ *  @return returns 0 if successful
+ */
+static int tdl_ring_init(void)
+{
+   struct tdl_ring *ring;
+   int cpu;
+
+   if (!ring_slots)
+   {
+      return 0;
+   }
+   for_each_possible_cpu(cpu)
+   {
+      ring = per_cpu_ptr(&tdl_rings, cpu);
+      ring->slots = kvmalloc_node(array_size(ring_slots, sizeof(*ring->slots)), GFP_KERNEL,
+                                  cpu_to_node(cpu));
+      if (!ring->slots)
+      {
+         return -ENOMEM;                   // the caller frees those already allocated
+      }
+   }
+   return 0;
+}
+
+/** @brief Free the rings.  Records still in them are lost. */
+static void tdl_ring_free(void)
+{
+   struct tdl_ring *ring;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+   {
+      ring = per_cpu_ptr(&tdl_rings, cpu);
+      kvfree(ring->slots);
+      ring->slots = NULL;
+   }
+}
+
+/** @brief Open a partition's entry in the statistics pages for an update.  Called with the
+ *  partition locked; readers in user space retry while seq is odd.
+ */
+static struct tdlchar_shm_part *tdl_shm_begin(struct tdl_partition *part)
+{
+   struct tdlchar_shm_part *shm = part->shm;
+
+   WRITE_ONCE(shm->seq, shm->seq + 1);
+   smp_wmb();
+   return shm;
+}
+
+/** @brief Copy the state of a partition's queue into its entry and close the update */
+static void tdl_shm_end(struct tdl_partition *part)
+{
+   struct tdlchar_shm_part *shm = part->shm;
+
+   shm->depth = part->depth;
+   shm->mem_bytes = part->mem_bytes;
+   shm->spill_bytes = part->spill_bytes;
+   smp_wmb();
+   WRITE_ONCE(shm->seq, shm->seq + 1);
+}
+
+/** @brief Add to (or with a negative count, take from) the bytes allocated for a partition */
+static void tdl_account(struct tdl_partition *part, s64 bytes)
+{
+   tdl_stat_max(&part->alloc_peak, atomic64_add_return(bytes, &part->alloc_bytes));
+   tdl_stat_max(&tdl_alloc_peak, atomic64_add_return(bytes, &tdl_alloc_bytes));
+}
+
+/** @brief Drop a reference to an arena chunk, freeing it with the last one.  Must be called with
+ *  the partition's arena_lock held.
+ *  @return the chunk if it has to be freed -- by the caller, after dropping the lock -- or NULL
+ */
+static struct tdl_chunk *tdl_chunk_put(struct tdl_chunk *chunk)
+{
+   return --chunk->live ? NULL : chunk;
+}
+
+/** @brief Free a chunk returned by tdl_chunk_put() */
+static void tdl_chunk_free(struct tdl_partition *part, struct tdl_chunk *chunk)
+{
+   if (chunk)
+   {
+      kvfree(chunk);
+      tdl_account(part, -(s64)arena_chunk);
+   }
+}
+
+/** @brief Carve a record of size bytes out of the partition's current arena chunk, starting a new
+ *  chunk when it is full.  Records in a partition are freed roughly in the order they were
+ *  written, so a chunk is usually freed soon after the next one is started.
+ *  @return the record with chunk set, or NULL
+ */
+static struct tdl_record *tdl_arena_alloc(struct tdl_partition *part, size_t size)
+{
+   struct tdl_chunk *chunk, *fresh = NULL, *old = NULL;
+   struct tdl_record *rec = NULL;
+
+   size = ALIGN(size, 8);             // keep every record 64-bit aligned
+   for (;;)
+   {
+      spin_lock(&part->arena_lock);
+      chunk = part->arena;
+      if (chunk && chunk->used + size <= arena_chunk - sizeof(*chunk))
+      {
+         rec = (struct tdl_record *)(chunk->data + chunk->used);
+         chunk->used += size;
+         chunk->live++;
+      }
+      else if (fresh)
+      {
+         old = chunk ? tdl_chunk_put(chunk) : NULL;  // freed when its last record is
+         chunk = part->arena = fresh;
+         fresh = NULL;
+         chunk->used = size;
+         chunk->live = 2;                            // the record and being current
+         rec = (struct tdl_record *)chunk->data;
+      }
+      spin_unlock(&part->arena_lock);
+      if (rec)
+      {
+         break;
+      }
+
+      // The chunk is full: allocate a new one outside the lock and try again
+      fresh = kvmalloc(arena_chunk, GFP_KERNEL_ACCOUNT);
+      if (!fresh)
+      {
+         return NULL;
+      }
+      tdl_account(part, arena_chunk);
+   }
+   tdl_chunk_free(part, fresh);      // another writer started a new chunk first
+   tdl_chunk_free(part, old);
+   rec->chunk = chunk;
+   return rec;
+}
+
+/** @brief Give a record's space back to its arena chunk, freeing the chunk with its last record */
+static void tdl_arena_free(struct tdl_partition *part, struct tdl_record *rec)
+{
+   struct tdl_chunk *chunk;
+
+   spin_lock(&part->arena_lock);
+   chunk = tdl_chunk_put(rec->chunk);
+   spin_unlock(&part->arena_lock);
+   tdl_chunk_free(part, chunk);
+}
+
+/** @brief The number of bytes allocated for a record: stubs of spilled records have no data[].
+ *  Records in an arena chunk count as 0, the chunk is counted as a whole.
+ */
+static size_t tdl_rec_size(const struct tdl_record *rec)
+{
+   if (rec->chunk)
+   {
+      return 0;
+   }
+   if (rec->pool_node >= 0)
+   {
+      return tdl_pool_buf_size;
+   }
+   if (rec->page_order >= 0)
+   {
+      return PAGE_SIZE << rec->page_order;
+   }
+   return rec->spilled ? sizeof(*rec) : struct_size(rec, data, rec->len);
+}
+
+/** @brief Allocate a record, or the stub of a spilled record, for a partition
+ *  In arena mode records are carved out of the partition's arena chunk.  Otherwise they come from
+ *  the buffer pool while it lasts, and after that are charged to the memory cgroup of the task
+ *  that allocates them -- the writer, or the reader that brings a spilled record back.  Records
+ *  larger than a page get a page block, recycled through the per-CPU page caches.  Stubs, which
+ *  can outlive the records around them, are always kmalloc'ed.  Every way is counted in the
+ *  memory statistics.  In deterministic mode records only come from the pool, whose latency is
+ *  bounded, and fail when it is empty.
+ *  @return the record with len and spilled set, or NULL
+ */
+static struct tdl_record *tdl_rec_alloc(struct tdl_partition *part, size_t len, bool spilled)
+{
+   struct tdl_record *rec = NULL;
+   size_t size = spilled ? sizeof(*rec) : struct_size(rec, data, len);
+   unsigned int order = get_order(size);
+   struct page *page;
+
+   if (!spilled && arena_chunk)
+   {
+      rec = tdl_arena_alloc(part, size);
+      if (!rec)
+      {
+         return NULL;
+      }
+      rec->pool_node = -1;
+      rec->page_order = -1;
+      size = 0;                       // counted when the chunk was allocated
+   }
+   else if (!spilled && size <= tdl_pool_buf_size && (rec = tdl_pool_get()))
+   {
+      size = tdl_pool_buf_size;
+      rec->page_order = -1;
+      rec->chunk = NULL;
+   }
+   else if (!spilled && deterministic)
+   {
+      return NULL;
+   }
+   else if (size > PAGE_SIZE && page_cache && order < TDL_PAGE_ORDERS)
+   {
+      page = tdl_pages_get(order);
+      if (!page)
+      {
+         return NULL;
+      }
+      rec = page_address(page);
+      rec->pool_node = -1;
+      rec->page_order = order;
+      rec->chunk = NULL;
+      size = PAGE_SIZE << order;
+   }
+   else
+   {
+      rec = kmalloc(size, GFP_KERNEL_ACCOUNT);
+      if (!rec)
+      {
+         return NULL;
+      }
+      rec->pool_node = -1;
+      rec->page_order = -1;
+      rec->chunk = NULL;
+   }
+   rec->len = len;
+   rec->spilled = spilled;
+   rec->refilled = false;
+   if (size)
+   {
+      tdl_account(part, size);
+   }
+   return rec;
+}
+
+/** @brief Free a record allocated by tdl_rec_alloc() */
+static void tdl_rec_free(struct tdl_partition *part, struct tdl_record *rec)
+{
+   size_t size = tdl_rec_size(rec);
+
+   if (size)
+   {
+      tdl_account(part, -(s64)size);
+   }
+   if (rec->chunk)
+   {
+      tdl_arena_free(part, rec);
+   }
+   else if (rec->pool_node >= 0)
+   {
+      tdl_pool_put(rec);
+   }
+   else if (rec->page_order >= 0)
+   {
+      tdl_pages_put(virt_to_page(rec), rec->page_order);
+   }
+   else
+   {
+      kfree(rec);
+   }
+}
+
+/** @brief Allocate and initialize the partition queues and fill the buffer pool.  tdl_parts is
+ *  only published once the queues are ready, since the parameter setters may look at it.
+ *  @return returns 0 if successful
+ */
+static int tdl_partitions_init(void)
+{
+   struct tdl_partition *parts;
+   unsigned int i;
+
+   parts = kcalloc(partitions, sizeof(*parts), GFP_KERNEL);
+   if (!parts)
+   {
+      return -ENOMEM;
+   }
+   tdl_shm_size = PAGE_ALIGN(struct_size(tdl_shm, part, partitions));
+   tdl_shm = vmalloc_user(tdl_shm_size);   // zeroed, and can be mapped into user space
+   if (!tdl_shm || tdl_ring_init())
+   {
+      tdl_ring_free();
+      vfree(tdl_shm);
+      kfree(parts);
+      return -ENOMEM;
+   }
+   tdl_shm->version = TDLCHAR_SHM_VERSION;
+   tdl_shm->size = struct_size(tdl_shm, part, partitions);
+   tdl_shm->partitions = partitions;
+   tdl_shm->buckets = TDLCHAR_SHM_BUCKETS;
+   tdl_pool_init();
+   tdl_pages_init();
+   for (i = 0; i < partitions; i++)
+   {
+      snprintf(parts[i].lock_stats.name, sizeof(parts[i].lock_stats.name), "partition%u", i);
+      tdl_lock_init(&parts[i].lock, &parts[i].lock_stats);
+      INIT_LIST_HEAD(&parts[i].records);
+      INIT_LIST_HEAD(&parts[i].cursors);
+      INIT_LIST_HEAD(&parts[i].spilled);
+      spin_lock_init(&parts[i].arena_lock);
+      init_waitqueue_head(&parts[i].writeq);
+      parts[i].shm = &tdl_shm->part[i];
+   }
+   kernel_param_lock(THIS_MODULE);
+   tdl_parts = parts;
+   kernel_param_unlock(THIS_MODULE);
+   return 0;
+}
+
+/** @brief Free any records that were never read, the partition queues, the buffer pool and the
+ *  rings of tdlchar_enqueue()
+ */
+static void tdl_partitions_free(void)
+{
+   struct tdl_partition *parts;
+   struct tdl_record *rec, *tmp;
+   unsigned int i;
+
+   kernel_param_lock(THIS_MODULE);          // no parameter setter is using them any more
+   parts = tdl_parts;
+   tdl_parts = NULL;
+   kernel_param_unlock(THIS_MODULE);
+
+   for (i = 0; i < partitions; i++)
+   {
+      list_for_each_entry_safe(rec, tmp, &parts[i].records, node)
+      {
+         tdl_rec_free(&parts[i], rec);
+      }
+      if (parts[i].arena)
+      {
+         tdl_chunk_free(&parts[i], tdl_chunk_put(parts[i].arena));
+      }
+      if (parts[i].spill_file)
+      {
+         fput(parts[i].spill_file);
+      }
+      mutex_destroy(&parts[i].lock.mutex);
+   }
+   kfree(parts);
+   vfree(tdl_shm);
+   tdl_ring_free();
+   tdl_pool_free();
+   tdl_pages_free();
+}
+
+/** @brief Show the total number of record bytes ever moved to the spill files */
+static ssize_t spill_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   return sysfs_emit(buf, "%lld\n", atomic64_read(&tdl_spilled_total));
+}
+static DEVICE_ATTR_RO(spill_bytes);
+
+/** @brief Show the total number of record bytes ever read back from the spill files */
+static ssize_t refill_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   return sysfs_emit(buf, "%lld\n", atomic64_read(&tdl_refilled_total));
+}
+static DEVICE_ATTR_RO(refill_bytes);
+
+/** @brief Show the number of record bytes currently held in the spill files */
+static ssize_t spilled_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   size_t total = 0;
+   unsigned int i;
+
+   for (i = 0; i < partitions; i++)
+   {
+      total += READ_ONCE(tdl_parts[i].spill_bytes);
+   }
+   return sysfs_emit(buf, "%zu\n", total);
+}
+static DEVICE_ATTR_RO(spilled);
+
+/** @brief Show the number of bytes currently allocated for records */
+static ssize_t bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   return sysfs_emit(buf, "%lld\n", atomic64_read(&tdl_alloc_bytes));
+}
+static DEVICE_ATTR_RO(bytes);
+
+/** @brief Show the high-water mark of bytes allocated for records */
+static ssize_t peak_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   return sysfs_emit(buf, "%lld\n", atomic64_read(&tdl_alloc_peak));
+}
+
+/** @brief Reset every high-water mark to the current usage.  Any write resets, like memory.peak. */
+static ssize_t peak_bytes_store(struct device *dev, struct device_attribute *attr,
+                                const char *buf, size_t count)
+{
+   unsigned int i;
+
+   atomic64_set(&tdl_alloc_peak, atomic64_read(&tdl_alloc_bytes));
+   for (i = 0; i < partitions; i++)
+   {
+      atomic64_set(&tdl_parts[i].alloc_peak, atomic64_read(&tdl_parts[i].alloc_bytes));
+   }
+   return count;
+}
+static DEVICE_ATTR_RW(peak_bytes);
+
+/** @brief Show the bytes allocated and the high-water mark of each partition, one per line.  With
+ *  hundreds of partitions of very large queues the list can be cut short at a page.
+ */
+static ssize_t partition_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   unsigned int i;
+   int len = 0;
+
+   for (i = 0; i < partitions && len < PAGE_SIZE - 1; i++)
+   {
+      len += sysfs_emit_at(buf, len, "%u %lld %lld\n", i,
+                           atomic64_read(&tdl_parts[i].alloc_bytes),
+                           atomic64_read(&tdl_parts[i].alloc_peak));
+   }
+   return len;
+}
+static DEVICE_ATTR_RO(partition_bytes);
+
+/** @brief Show the number of records that got a buffer from the pool */
+static ssize_t pool_hits_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   return sysfs_emit(buf, "%lld\n", atomic64_read(&tdl_pool_hits));
+}
+static DEVICE_ATTR_RO(pool_hits);
+
+/** @brief Show the number of records that found the pool empty */
+static ssize_t pool_misses_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   return sysfs_emit(buf, "%lld\n", atomic64_read(&tdl_pool_misses));
+}
+static DEVICE_ATTR_RO(pool_misses);
+
+/** @brief Show the number of buffers waiting in the pool */
+static ssize_t pool_free_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   unsigned int total = 0;
+   int node;
+
+   for (node = 0; tdl_pools && node < nr_node_ids; node++)
+   {
+      total += READ_ONCE(tdl_pools[node].count);
+   }
+   return sysfs_emit(buf, "%u\n", total);
+}
+static DEVICE_ATTR_RO(pool_free);
+
+/** @brief Show the number of large records that reused a cached page block */
+static ssize_t page_hits_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   return sysfs_emit(buf, "%lld\n", atomic64_read(&tdl_page_hits));
+}
+static DEVICE_ATTR_RO(page_hits);
+
+/** @brief Show the number of large records that had to get pages from the page allocator */
+static ssize_t page_misses_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   return sysfs_emit(buf, "%lld\n", atomic64_read(&tdl_page_misses));
+}
+static DEVICE_ATTR_RO(page_misses);
+
+/** @brief Show the number of page blocks given back to the page allocator */
+static ssize_t page_releases_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   return sysfs_emit(buf, "%lld\n", atomic64_read(&tdl_page_releases));
+}
+static DEVICE_ATTR_RO(page_releases);
+
+/** @brief Show the number of page blocks left to a pipe that still had pages of them */
+static ssize_t page_pipe_held_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   return sysfs_emit(buf, "%lld\n", atomic64_read(&tdl_page_pipe_held));
+}
+static DEVICE_ATTR_RO(page_pipe_held);
+
+// Memory use appears in /sys/class/tdl/tdlchar/memory/
+static struct attribute *tdl_memory_attrs[] =
+{
+   &dev_attr_bytes.attr,
+   &dev_attr_peak_bytes.attr,
+   &dev_attr_partition_bytes.attr,
+   &dev_attr_pool_hits.attr,
+   &dev_attr_pool_misses.attr,
+   &dev_attr_pool_free.attr,
+   &dev_attr_page_hits.attr,
+   &dev_attr_page_misses.attr,
+   &dev_attr_page_releases.attr,
+   &dev_attr_page_pipe_held.attr,
+   NULL,
+};
+
+static const struct attribute_group tdl_memory_group =
+{
+   .name  = "memory",
+   .attrs = tdl_memory_attrs,
+};
+
+/** @brief Show how long the module took from being loaded to having its device ready */
+static ssize_t init_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   return sysfs_emit(buf, "%llu\n", READ_ONCE(tdl_init_ns) / NSEC_PER_USEC);
+}
+static DEVICE_ATTR_RO(init_us);
+
+/** @brief Show 1 once /dev/tdlchar exists, and 0 until then or if creating it failed.  This is an
+ *  attribute of the class, /sys/class/tdl/ready, since without the device there are no others.
+ */
+static ssize_t ready_show(struct class *class, struct class_attribute *attr, char *buf)
+{
+   return sysfs_emit(buf, "%d\n", READ_ONCE(tdlcharDevice) != NULL);
+}
+static CLASS_ATTR_RO(ready);
+
+/** @brief Show the number of records from tdlchar_enqueue() queued on a partition */
+static ssize_t ring_queued_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   return sysfs_emit(buf, "%lld\n", atomic64_read(&tdl_ring_queued));
+}
+static DEVICE_ATTR_RO(ring_queued);
+
+/** @brief Show the number of records from tdlchar_enqueue() that were dropped */
+static ssize_t ring_dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+   return sysfs_emit(buf, "%lld\n", atomic64_read(&tdl_ring_dropped));
+}
+static DEVICE_ATTR_RO(ring_dropped);
+
+// The statistics appear in /sys/class/tdl/tdlchar/stats/
+static struct attribute *tdl_stats_attrs[] =
+{
+   &dev_attr_spill_bytes.attr,
+   &dev_attr_refill_bytes.attr,
+   &dev_attr_spilled.attr,
+   &dev_attr_init_us.attr,
+   &dev_attr_ring_queued.attr,
+   &dev_attr_ring_dropped.attr,
+   NULL,
+};
+
+static const struct attribute_group tdl_stats_group =
+{
+   .name  = "stats",
+   .attrs = tdl_stats_attrs,
+};
+
+/** @brief Read the transform table in use, one output byte per input byte */
+static ssize_t lut_read(struct file *filep, struct kobject *kobj, struct bin_attribute *attr,
+                        char *buf, loff_t off, size_t count)
+{
+   rcu_read_lock();
+   memcpy(buf, rcu_dereference(tdl_xform)->lut + off, count);   // sysfs keeps us within size
+   rcu_read_unlock();
+   return count;
+}
+
+/** @brief Load a custom transform table.  It has to be written whole, in one write() */
+static ssize_t lut_write(struct file *filep, struct kobject *kobj, struct bin_attribute *attr,
+                         char *buf, loff_t off, size_t count)
+{
+   struct tdl_xform *xf;
+
+   if (off != 0 || count != sizeof(xf->lut))
+   {
+      return -EINVAL;
+   }
+   xf = kmalloc(sizeof(*xf), GFP_KERNEL);
+   if (!xf)
+   {
+      return -ENOMEM;
+   }
+   xf->mode = TDL_XFORM_CUSTOM;
+   memcpy(xf->lut, buf, count);
+   tdl_xform_publish(xf);
+   return count;
+}
+static BIN_ATTR_RW(lut, 256);
+
+// The transform table appears as /sys/class/tdl/tdlchar/transform/lut
+static struct bin_attribute *tdl_transform_bin_attrs[] =
+{
+   &bin_attr_lut,
+   NULL,
+};
+
+static const struct attribute_group tdl_transform_group =
+{
+   .name      = "transform",
+   .bin_attrs = tdl_transform_bin_attrs,
+};
+
+static const struct attribute_group *tdl_attr_groups[] =
+{
+   &tdl_stats_group,
+   &tdl_memory_group,
+   &tdl_transform_group,
+   NULL,
+};
+
+/** @brief Call fn on the statistics of every lock, the per-partition ones last */
+static void tdl_for_each_lock_stats(struct seq_file *m,
+                                    void (*fn)(struct seq_file *, struct tdl_lock_stats *))
+{
+   unsigned int i;
+
+   fn(m, &tdl_groups_lock_stats);
+   fn(m, &tdl_group_lock_stats);
+   fn(m, &tdl_session_lock_stats);
+   for (i = 0; i < partitions; i++)
+   {
+      fn(m, &tdl_parts[i].lock_stats);
+   }
+}
+
+/** @brief Print one row of /sys/kernel/debug/tdlchar/locks */
+static void tdl_show_lock_row(struct seq_file *m, struct tdl_lock_stats *stats)
+{
+   seq_printf(m, "%-14s %12lld %12lld %16lld %12lld %16lld %12lld\n", stats->name,
+              atomic64_read(&stats->acquired), atomic64_read(&stats->contended),
+              atomic64_read(&stats->wait_ns), atomic64_read(&stats->wait_max),
+              atomic64_read(&stats->hold_ns), atomic64_read(&stats->hold_max));
+}
+
+/** @brief Show the totals of every lock */
+static int tdl_locks_show(struct seq_file *m, void *v)
+{
+   seq_printf(m, "%-14s %12s %12s %16s %12s %16s %12s\n", "lock", "acquired", "contended",
+              "wait_ns", "wait_max_ns", "hold_ns", "hold_max_ns");
+   tdl_for_each_lock_stats(m, tdl_show_lock_row);
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tdl_locks);
+
+/** @brief Print the non-empty buckets of a histogram */
+static void tdl_show_hist(struct seq_file *m, const char *what, atomic64_t *hist)
+{
+   unsigned int b;
+   s64 count;
+
+   for (b = 0; b < TDL_HIST_BUCKETS; b++)
+   {
+      count = atomic64_read(&hist[b]);
+      if (!count)
+      {
+         continue;
+      }
+      if (b == 0)
+      {
+         seq_printf(m, "  %s %12s %12u ns %12lld\n", what, "", 0, count);
+      }
+      else if (b == TDL_HIST_BUCKETS - 1)
+      {
+         seq_printf(m, "  %s %12llu %12s ns %12lld\n", what, 1ULL << (b - 1), "...", count);
+      }
+      else
+      {
+         seq_printf(m, "  %s %12llu %12llu ns %12lld\n", what, 1ULL << (b - 1), 1ULL << b, count);
+      }
+   }
+}
+
+/** @brief Print the wait and hold histograms of a lock that has been taken */
+static void tdl_show_lock_hist(struct seq_file *m, struct tdl_lock_stats *stats)
+{
+   if (!atomic64_read(&stats->acquired))
+   {
+      return;
+   }
+   seq_printf(m, "%s:\n", stats->name);
+   tdl_show_hist(m, "wait", stats->wait_hist);
+   tdl_show_hist(m, "hold", stats->hold_hist);
+}
+
+/** @brief Show the histograms of every lock that has been taken */
+static int tdl_lock_hist_show(struct seq_file *m, void *v)
+{
+   tdl_for_each_lock_stats(m, tdl_show_lock_hist);
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tdl_lock_hist);
+
+/** @brief Show the longest lock holds, longest first */
+static int tdl_lock_holders_show(struct seq_file *m, void *v)
+{
+   struct tdl_holder holders[TDL_TOP_HOLDERS], tmp;
+   unsigned int i, j;
+
+   spin_lock(&tdl_holders_lock);
+   memcpy(holders, tdl_holders, sizeof(holders));
+   spin_unlock(&tdl_holders_lock);
+
+   for (i = 1; i < TDL_TOP_HOLDERS; i++)   // insertion sort, it's only a few entries
+   {
+      for (j = i; j > 0 && holders[j].held_ns > holders[j - 1].held_ns; j--)
+      {
+         tmp = holders[j];
+         holders[j] = holders[j - 1];
+         holders[j - 1] = tmp;
+      }
+   }
+   seq_printf(m, "%14s %8s %-16s %s\n", "hold_ns", "pid", "comm", "lock");
+   for (i = 0; i < TDL_TOP_HOLDERS && holders[i].held_ns; i++)
+   {
+      seq_printf(m, "%14llu %8d %-16s %s\n", holders[i].held_ns, holders[i].pid,
+                 holders[i].comm, holders[i].lock);
+   }
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tdl_lock_holders);
+
+/** @brief Show the slow operations still in the ring, oldest first */
+static int tdl_slow_ops_show(struct seq_file *m, void *v)
+{
+   u64 last = atomic64_read(&tdl_slow_next);
+   u64 ticket = last > TDL_SLOW_RING ? last - TDL_SLOW_RING + 1 : 1;
+   struct tdl_slow_op *slot, copy;
+
+   seq_printf(m, "%16s %8s %-16s %-5s %6s %12s %12s %12s %12s\n", "when_ns", "pid", "comm", "op",
+              "size", "total_ns", "wait_ns", "copy_ns", "queue_ns");
+   for (; ticket <= last; ticket++)
+   {
+      slot = &tdl_slow_ring[ticket & (TDL_SLOW_RING - 1)];
+      if (READ_ONCE(slot->ticket) != ticket)
+      {
+         continue;                         // being written, or already overwritten
+      }
+      smp_rmb();
+      copy = *slot;
+      smp_rmb();
+      if (READ_ONCE(slot->ticket) != ticket)
+      {
+         continue;
+      }
+      seq_printf(m, "%16llu %8d %-16s %-5s %6zu %12llu %12llu %12llu %12llu\n", copy.when_ns,
+                 copy.pid, copy.comm, copy.op == TDL_OP_READ ? "read" : "write", copy.size,
+                 copy.total_ns, copy.phase_ns[TDL_PHASE_WAIT], copy.phase_ns[TDL_PHASE_COPY],
+                 copy.phase_ns[TDL_PHASE_QUEUE]);
+   }
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tdl_slow_ops);
+
+/** @brief What /sys/kernel/debug/tdlchar/records shows of a queued record */
+struct tdl_peek
+{
+   u64  seq;
+   u32  len;
+   u32  unread;                             ///< Groups that have yet to read it
+   bool spilled;
+   u8   prefix_len;
+   char prefix[TDL_PEEK_PREFIX];
+};
+
+/** @brief Start /sys/kernel/debug/tdlchar/records: the header, then one element per partition */
+static void *tdl_records_start(struct seq_file *m, loff_t *pos)
+{
+   if (*pos == 0)
+   {
+      return SEQ_START_TOKEN;
+   }
+   return *pos <= partitions ? &tdl_parts[*pos - 1] : NULL;
+}
+
+static void *tdl_records_next(struct seq_file *m, void *v, loff_t *pos)
+{
+   ++*pos;
+   return tdl_records_start(m, pos);
+}
+
+static void tdl_records_stop(struct seq_file *m, void *v)
+{
+}
+
+/** @brief Show the records queued in a partition without taking any of them off the queue
+ *  The partition lock is only held while the metadata and the first few bytes of each record are
+ *  copied out, so looking at a deep backlog barely holds up the writers and readers.
+ */
+static int tdl_records_show(struct seq_file *m, void *v)
+{
+   struct tdl_partition *part = v;
+   struct tdl_record *rec;
+   struct tdl_cursor *cur;
+   struct tdl_peek *peek;
+   unsigned int n, i = 0, more = 0;
+
+   if (v == SEQ_START_TOKEN)
+   {
+      seq_printf(m, "%9s %12s %8s %5s %6s %s\n", "partition", "seq", "len", "where", "unread",
+                 "data");
+      return 0;
+   }
+   n = READ_ONCE(part->depth);
+   if (n == 0)
+   {
+      return 0;
+   }
+   peek = kvmalloc_array(n, sizeof(*peek), GFP_KERNEL);
+   if (!peek)
+   {
+      return -ENOMEM;
+   }
+
+   tdl_lock(&part->lock);
+   list_for_each_entry(rec, &part->records, node)
+   {
+      if (i == n)
+      {
+         more++;                            // queued since the array was sized
+         continue;
+      }
+      peek[i].seq = rec->seq;
+      peek[i].len = rec->len;
+      peek[i].spilled = rec->spilled;
+      peek[i].prefix_len = rec->spilled ? 0 : min_t(size_t, rec->len, TDL_PEEK_PREFIX);
+      memcpy(peek[i].prefix, rec->data, peek[i].prefix_len);
+      peek[i].unread = 0;
+      list_for_each_entry(cur, &part->cursors, node)
+      {
+         if (cur->next && rec->seq >= cur->seq)
+         {
+            peek[i].unread++;
+         }
+      }
+      i++;
+   }
+   tdl_unlock(&part->lock);
+
+   for (n = i, i = 0; i < n; i++)
+   {
+      seq_printf(m, "%9td %12llu %8u %5s %6u %*pE\n", part - tdl_parts, peek[i].seq, peek[i].len,
+                 peek[i].spilled ? "spill" : "mem", peek[i].unread, peek[i].prefix_len,
+                 peek[i].prefix);
+   }
+   if (more)
+   {
+      seq_printf(m, "%9td ... %u more\n", part - tdl_parts, more);
+   }
+   kvfree(peek);
+   return 0;
+}
+
+static const struct seq_operations tdl_records_sops =
+{
+   .start = tdl_records_start,
+   .next  = tdl_records_next,
+   .stop  = tdl_records_stop,
+   .show  = tdl_records_show,
+};
+DEFINE_SEQ_ATTRIBUTE(tdl_records);
+
+/** @brief Create /sys/kernel/debug/tdlchar.  Like all debugfs users, carry on if this fails. */
+static void tdl_debugfs_init(void)
+{
+   tdl_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+   debugfs_create_file("locks", 0444, tdl_debugfs, NULL, &tdl_locks_fops);
+   debugfs_create_file("lock_hist", 0444, tdl_debugfs, NULL, &tdl_lock_hist_fops);
+   debugfs_create_file("lock_holders", 0444, tdl_debugfs, NULL, &tdl_lock_holders_fops);
+   debugfs_create_file("slow_ops", 0444, tdl_debugfs, NULL, &tdl_slow_ops_fops);
+   debugfs_create_file("records", 0400, tdl_debugfs, NULL, &tdl_records_fops);
+}
+
+/** @brief Create the device node once the rest of the module is up, so that loading the module
+ *  doesn't wait for the driver core and udev.  The attribute groups are created together with the
+ *  device, so udev gets a single add event with everything in place rather than an add followed by
+ *  a change per attribute group.  This is also where the one line about the load is logged.
+ */
+static void tdl_create_device(struct work_struct *work)
+{
+   struct device *dev;
+
+   // Register the device driver, hard-code minor number of zero
+   dev = device_create_with_groups(tdlcharClass, NULL, MKDEV(majorNumber, 0), NULL,
+                                   tdl_attr_groups, DEVICE_NAME);
+   if (IS_ERR(dev))
+   {
+      // The module stays loaded without it, and /sys/class/tdl/ready reads 0
+      pr_err("TDLChar: failed to create /dev/%s (%ld)\n", DEVICE_NAME, PTR_ERR(dev));
+      return;
+   }
+   WRITE_ONCE(tdlcharDevice, dev);
+   WRITE_ONCE(tdl_init_ns, ktime_get_ns() - tdl_init_start);
+   printk(KERN_INFO "TDLChar: /dev/%s ready, major %d, %u partitions, loaded in %llu us\n",
+          DEVICE_NAME, majorNumber, partitions, tdl_init_ns / NSEC_PER_USEC);
+}
+
+static DECLARE_WORK(tdl_device_work, tdl_create_device);  ///< Runs tdl_create_device()
+
+// Every record is also multicast to the members of the "records" group of the tdlchar generic
+// netlink family, if it has any.  netlink clones the one message for each of them and buffers it in
+// their sockets, so a slow subscriber loses messages rather than holding up the device.
+
+static const struct genl_multicast_group tdl_genl_mcgrps[] =
+{
+   { .name = TDLCHAR_GENL_MCGRP, .flags = GENL_UNS_ADMIN_PERM },   // records may be private
+};
+
+static struct genl_family tdl_genl_family =
+{
+   .name      = TDLCHAR_GENL_NAME,
+   .version   = TDLCHAR_GENL_VERSION,
+   .maxattr   = TDLCHAR_A_MAX,
+   .module    = THIS_MODULE,
+   .mcgrps    = tdl_genl_mcgrps,
+   .n_mcgrps  = ARRAY_SIZE(tdl_genl_mcgrps),
+};
+
+/** @brief Build the multicast message of a record, outside the partition lock
+ *  The sequence number is only known once the record is queued, so room is left for it and its
+ *  address returned in seq.
+ *  @return the message, or NULL if nobody is listening or it could not be allocated
+ */
+static struct sk_buff *tdl_genl_prepare(struct tdl_partition *part, const char *data, size_t len,
+                                        u64 **seq)
+{
+   struct sk_buff *skb;
+   struct nlattr *attr;
+   void *hdr;
+
+   // Deterministic mode skips the allocation and the copy for every subscriber
+   if (deterministic || !genl_has_listeners(&tdl_genl_family, &init_net, 0))
+   {
+      return NULL;
+   }
+   skb = genlmsg_new(nla_total_size(sizeof(u32)) + nla_total_size_64bit(sizeof(u64)) +
+                     nla_total_size(len), GFP_KERNEL);
+   if (!skb)
+   {
+      return NULL;
+   }
+   hdr = genlmsg_put(skb, 0, 0, &tdl_genl_family, 0, TDLCHAR_CMD_RECORD);
+   if (!hdr || nla_put_u32(skb, TDLCHAR_A_PARTITION, part - tdl_parts))
+   {
+      nlmsg_free(skb);
+      return NULL;
+   }
+   attr = nla_reserve_64bit(skb, TDLCHAR_A_SEQ, sizeof(u64), TDLCHAR_A_PAD);
+   if (!attr || nla_put(skb, TDLCHAR_A_DATA, len, data))
+   {
+      nlmsg_free(skb);
+      return NULL;
+   }
+   genlmsg_end(skb, hdr);
+   *seq = nla_data(attr);
+   return skb;
+}
+
+#ifdef TDL_BPF
+// A BPF program becomes the transform stage by attaching to tdlchar_bpf_transform() with fmod_ret.
+// It edits the record through the kfuncs below and returns 0 to have the transform table applied
+// as well, a positive value to skip the table, or a negative errno to fail the write.
+
+/** @brief A record as a BPF transform program sees it */
+struct tdlchar_bpf_ctx
+{
+   char *data;                              ///< The record, changed in place
+   u32   len;                               ///< Bytes in data
+   u32   partition;                         ///< Partition the record is going to
+};
+
+#ifndef __bpf_kfunc
+#define __bpf_kfunc __used noinline
+#endif
+
+__diag_push();
+__diag_ignore_all("-Wmissing-prototypes", "Global functions called by BPF programs");
+
+/** @brief The attach point of BPF transform programs.  Does nothing by itself. */
+noinline int tdlchar_bpf_transform(struct tdlchar_bpf_ctx *ctx)
+{
+   // Keeps the compiler from treating the call as pure and folding the 0 into the caller, which
+   // would ignore what an fmod_ret program returns
+   asm volatile("" ::: "memory");
+   return 0;
+}
+ALLOW_ERROR_INJECTION(tdlchar_bpf_transform, ERRNO);
+
+/** @brief Give a BPF program direct access to rdwr_buf_size bytes of the record from off
+ *  @return NULL if the record is not that long
+ */
+__bpf_kfunc u8 *tdlchar_data(struct tdlchar_bpf_ctx *ctx, u32 off, const int rdwr_buf_size)
+{
+   if (rdwr_buf_size < 0 || off > ctx->len || rdwr_buf_size > ctx->len - off)
+   {
+      return NULL;
+   }
+   return ctx->data + off;
+}
+
+/** @brief Convert len bytes of the record from off to upper case, or to lower case if !upper */
+__bpf_kfunc int tdlchar_case(struct tdlchar_bpf_ctx *ctx, u32 off, u32 len, int upper)
+{
+   if (off > ctx->len || len > ctx->len - off)
+   {
+      return -EINVAL;
+   }
+   tdl_xform_apply(tdl_xforms[upper ? TDL_XFORM_UPPER : TDL_XFORM_LOWER].lut, ctx->data + off,
+                   len);
+   return 0;
+}
+
+/** @brief Run len bytes of the record from off through lut, a 256-byte table the program owns */
+__bpf_kfunc int tdlchar_lut(struct tdlchar_bpf_ctx *ctx, u32 off, u32 len, const u8 *lut,
+                            u32 lut__sz)
+{
+   if (lut__sz != 256 || off > ctx->len || len > ctx->len - off)
+   {
+      return -EINVAL;
+   }
+   tdl_xform_apply(lut, ctx->data + off, len);
+   return 0;
+}
+
+__diag_pop();
+
+BTF_SET8_START(tdl_kfunc_ids)
+BTF_ID_FLAGS(func, tdlchar_data, KF_RET_NULL)
+BTF_ID_FLAGS(func, tdlchar_case)
+BTF_ID_FLAGS(func, tdlchar_lut)
+BTF_SET8_END(tdl_kfunc_ids)
+
+static const struct btf_kfunc_id_set tdl_kfunc_set =
+{
+   .owner = THIS_MODULE,
+   .set   = &tdl_kfunc_ids,
+};
+
+/** @brief Make the kfuncs callable from tracing programs.  The device works without them. */
+static void tdl_bpf_init(void)
+{
+   int ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_TRACING, &tdl_kfunc_set);
+
+   if (ret)
+   {
+      printk(KERN_WARNING "TDLChar: BPF transforms unavailable (%d)\n", ret);
+   }
+}
+
+/** @brief Let an attached BPF program transform a record
+ *  @return 0 to apply the transform table too, > 0 to skip it, or a negative errno
+ */
+static int tdl_bpf_transform(struct tdl_partition *part, char *data, size_t len)
+{
+   struct tdlchar_bpf_ctx ctx =
+   {
+      .data      = data,
+      .len       = len,
+      .partition = part - tdl_parts,
+   };
+
+   return tdlchar_bpf_transform(&ctx);
+}
+#else
+static void tdl_bpf_init(void)
+{
+}
+
+static int tdl_bpf_transform(struct tdl_partition *part, char *data, size_t len)
+{
+   return 0;
+}
+#endif
+
+/** @brief The LKM initialization function
+ *  The static keyword restricts the visibility of the function to within this C file. The __init
+ *  macro means that for a built-in driver (not a LKM) the function is only used at initialization
+ *  time and that it can be discarded and its memory freed up after that point.
+ *  @return returns 0 if successful
+ */
+static int __init tdlchar_init(void)
+{
+   int ret;
+
+   tdl_init_start = ktime_get_ns();
+
+   if (partitions < 1 || partitions > MAX_PARTITIONS || queue_depth < 1)
+   {
+      printk(KERN_ALERT "TDLChar: partitions must be 1-%d and queue_depth at least 1\n",
+             MAX_PARTITIONS);
+      return -EINVAL;
+   }
+   // A record has to fit in one spill batch
+   if (message_pages < 1 || MESSAGE_LENGTH > SPILL_BATCH || page_cache > TDL_PAGE_CACHE_MAX)
+   {
+      printk(KERN_ALERT "TDLChar: message_pages must be 1-%lu and page_cache at most %d\n",
+             SPILL_BATCH / PAGE_SIZE, TDL_PAGE_CACHE_MAX);
+      return -EINVAL;
+   }
+   // An arena chunk has to hold at least the largest record
+   if (arena_chunk && arena_chunk < TDL_ARENA_MIN)
+   {
+      printk(KERN_ALERT "TDLChar: arena_chunk must be 0 or at least %zu\n", TDL_ARENA_MIN);
+      return -EINVAL;
+   }
+
+   // Deterministic mode takes every record from the pool and never waits for a spill file
+   if (deterministic && (!pool_buffers || spill_threshold || arena_chunk))
+   {
+      printk(KERN_ALERT "TDLChar: deterministic needs pool_buffers, and no spill_threshold or "
+             "arena_chunk\n");
+      return -EINVAL;
+   }
+   if (deterministic && !IS_ENABLED(CONFIG_PREEMPT_RT))
+   {
+      printk(KERN_WARNING "TDLChar: locks only inherit priority on PREEMPT_RT kernels\n");
+   }
+   if (ring_slots > TDL_RING_MAX || (ring_slots & (ring_slots - 1)))
+   {
+      printk(KERN_ALERT "TDLChar: ring_slots must be 0 or a power of two up to %d\n",
+             TDL_RING_MAX);
+      return -EINVAL;
+   }
+
+   // The queues and transform tables must exist before the device is visible to user space
+   tdl_xform_build();
+   ret = tdl_partitions_init();
+   if (ret)
+   {
+      printk(KERN_ALERT "TDLChar failed to allocate %u partitions\n", partitions);
+      return ret;
+   }
+
+   // Try to dynamically allocate a major number for the device -- more difficult but worth it
+   majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
+   if (majorNumber<0)
+   {
+      tdl_partitions_free();
+      printk(KERN_ALERT "TDLChar failed to register a major number\n");
+      return majorNumber;
+   }
+
+   // Register the device class
+   tdlcharClass = class_create(THIS_MODULE, CLASS_NAME);
+
+   // Check for error and clean up if there is
+   if (IS_ERR(tdlcharClass))
+   {
+      unregister_chrdev(majorNumber, DEVICE_NAME);
+      tdl_partitions_free();
+      printk(KERN_ALERT "Failed to register device class\n");
+      return PTR_ERR(tdlcharClass);          // Correct way to return an error on a pointer
+   }
+   ret = class_create_file(tdlcharClass, &class_attr_ready);
+   if (ret)
+   {
+      class_destroy(tdlcharClass);
+      unregister_chrdev(majorNumber, DEVICE_NAME);
+      tdl_partitions_free();
+      printk(KERN_ALERT "TDLChar failed to create the class's ready attribute\n");
+      return ret;
+   }
+
+   ret = genl_register_family(&tdl_genl_family);
+   if (ret)
+   {
+      class_destroy(tdlcharClass);
+      unregister_chrdev(majorNumber, DEVICE_NAME);
+      tdl_partitions_free();
+      printk(KERN_ALERT "TDLChar failed to register its netlink family\n");
+      return ret;
+   }
+
+   // The core is ready: the device node and its uevent follow from a work item
+   tdl_debugfs_init();
+   tdl_bpf_init();
+   schedule_work(&tdl_device_work);
+   return 0;
+}
+
+/** @brief The LKM cleanup function
+ *  Similar to the initialization function, it is static. The __exit macro notifies that if this
+ *  code is used for a built-in driver (not a LKM) that this function is not required.
+ */
+static void __exit tdlchar_exit(void)
+{
+   cancel_work_sync(&tdl_device_work);                      // the device may not exist yet
+   irq_work_sync(&tdl_ring_irq_work);                       // no module calls tdlchar_enqueue()
+   flush_work(&tdl_ring_work);                              // ... so this is its last drain
+   debugfs_remove_recursive(tdl_debugfs);                   // remove the lock statistics
+   if (tdlcharDevice)
+   {
+      device_destroy(tdlcharClass, MKDEV(majorNumber, 0));  // remove the device
+   }
+   tdl_xform_publish(&tdl_xforms[TDL_XFORM_NONE]);          // free a custom transform table
+   genl_unregister_family(&tdl_genl_family);                // stop multicasting records
+   class_remove_file(tdlcharClass, &class_attr_ready);
+   class_unregister(tdlcharClass);                          // unregister the device class
+   class_destroy(tdlcharClass);                             // remove the device class
+   unregister_chrdev(majorNumber, DEVICE_NAME);             // unregister the major number
+   tdl_partitions_free();                                   // drop any unread records
+   printk(KERN_INFO "TDLChar: Goodbye from the LKM!\n");
+}
+
+/** @brief The device open function that is called each time the device is opened
+ *  This allocates the per-open state and increments the numberOpens counter.
+ *  @param inodep A pointer to an inode object (defined in linux/fs.h)
+ *  @param filep A pointer to a file object (defined in linux/fs.h)
+ */
+static int dev_open(struct inode *inodep, struct file *filep)
+{
+   struct tdl_session *session = kzalloc(sizeof(*session), GFP_KERNEL_ACCOUNT);
+   if (!session)
+   {
+      return -ENOMEM;
+   }
+   tdl_lock_init(&session->lock, &tdl_session_lock_stats);
+   INIT_LIST_HEAD(&session->member);
+   session->bound = -1;                     // partitions are assigned automatically
+   filep->private_data = session;
+
+   tdl_printk(KERN_INFO "TDLChar: Device has been opened %d time(s)\n",
+              atomic_inc_return(&numberOpens));
+   return 0;
+}
+
+/** @brief Pick the partition a write on this file goes to
+ *  Records with a key are hashed by it.  Records without one are hashed by the open file, so each
+ *  writer's own records still stay in order.
+ */
+static struct tdl_partition *tdl_write_partition(struct file *filep)
+{
+   struct tdl_session *session = filep->private_data;
+   u32 hash = session->has_key ? session->key_hash : hash_ptr(filep, 32);
+   return &tdl_parts[reciprocal_scale(hash, partitions)];
+}
+
+/** @brief Check whether a record is the next one some group will read */
+static bool tdl_is_next(struct tdl_partition *part, struct tdl_record *rec)
+{
+   struct tdl_cursor *cur;
+
+   list_for_each_entry(cur, &part->cursors, node)
+   {
+      if (cur->next == rec)
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+/** @brief Check whether a record may be moved to the spill file
+ *  Records that are about to be read stay in memory, and a record is spilled at most once so a
+ *  backlog that hovers around the threshold doesn't bounce records in and out.
+ */
+static bool tdl_spillable(struct tdl_partition *part, struct tdl_record *rec)
+{
+   return !rec->spilled && !rec->refilled && !tdl_is_next(part, rec);
+}
+
+/** @brief Give spill file space that no record uses any more back to shmem
+ *  Must be called with the partition lock held.
+ */
+static void tdl_spill_reclaim(struct tdl_partition *part)
+{
+   struct tdl_record *first;
+   loff_t end;
+
+   if (!part->spill_file)
+   {
+      return;
+   }
+   first = list_first_entry_or_null(&part->spilled, struct tdl_record, spill_node);
+   end = first ? round_down(first->spill_off, PAGE_SIZE) : part->spill_tail;
+   if (end > part->spill_punched)
+   {
+      vfs_fallocate(part->spill_file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    part->spill_punched, end - part->spill_punched);
+      part->spill_punched = end;
+   }
+   if (!first)
+   {
+      part->spill_tail = part->spill_punched = 0;   // nothing spilled, start over at the front
+   }
+}
+
+/** @brief Move the older records of a partition to its spill file once it holds more than
+ *  spill_threshold bytes in memory, until it is down to half of that
+ *  Records are copied into a batch buffer and written with one kernel_write(), then swapped for
+ *  stubs.  Must be called with the partition lock held.
+ */
+static void tdl_spill(struct tdl_partition *part)
+{
+   struct tdl_record *rec, *tmp, *first, *stub;
+   unsigned int count, done;
+   size_t n;
+   loff_t pos;
+   char *batch;
+
+   if (!spill_threshold || part->mem_bytes <= spill_threshold)
+   {
+      return;
+   }
+   if (!part->spill_file)
+   {
+      struct file *file = shmem_file_setup("tdlchar-spill", 0, VM_NORESERVE);
+      if (IS_ERR(file))
+      {
+         pr_warn_ratelimited("TDLChar: failed to create a spill file (%ld)\n", PTR_ERR(file));
+         return;
+      }
+      part->spill_file = file;
+   }
+   batch = kvmalloc(SPILL_BATCH, GFP_KERNEL);
+   if (!batch)
+   {
+      return;
+   }
+
+   while (part->mem_bytes > spill_threshold / 2)
+   {
+      // Gather the oldest spillable records that fit in one batch
+      first = NULL;
+      n = 0;
+      count = 0;
+      list_for_each_entry(rec, &part->records, node)
+      {
+         if (!tdl_spillable(part, rec))
+         {
+            continue;
+         }
+         if (n + rec->len > SPILL_BATCH || part->mem_bytes - n <= spill_threshold / 2)
+         {
+            break;
+         }
+         if (!first)
+         {
+            first = rec;
+         }
+         rec->spill_off = part->spill_tail + n;
+         memcpy(batch + n, rec->data, rec->len);
+         n += rec->len;
+         count++;
+      }
+      if (!count)
+      {
+         break;
+      }
+
+      pos = part->spill_tail;
+      if (kernel_write(part->spill_file, batch, n, &pos) != n)
+      {
+         pr_warn_ratelimited("TDLChar: failed to write %zu bytes to a spill file\n", n);
+         break;
+      }
+      part->spill_tail = pos;
+      atomic64_add(n, &tdl_spilled_total);
+
+      // Swap the same records, in the same order, for stubs that point into the file
+      done = 0;
+      rec = first;
+      list_for_each_entry_safe_from(rec, tmp, &part->records, node)
+      {
+         if (done == count)
+         {
+            break;
+         }
+         if (!tdl_spillable(part, rec))
+         {
+            continue;
+         }
+         done++;
+         stub = tdl_rec_alloc(part, rec->len, true);
+         if (!stub)
+         {
+            rec->refilled = true;  // stays in memory, its copy in the file is simply unused
+            continue;
+         }
+         stub->seq = rec->seq;
+         stub->off = rec->off;
+         stub->spill_off = rec->spill_off;
+         list_replace(&rec->node, &stub->node);
+         list_add_tail(&stub->spill_node, &part->spilled);
+         part->mem_bytes -= rec->len;
+         part->spill_bytes += rec->len;
+         tdl_rec_free(part, rec);
+      }
+   }
+   kvfree(batch);
+}
+
+/** @brief Read a spilled record back into memory, along with the spilled records stored right
+ *  after it in the file, so a reader working through a spilled backlog reads the file in batches.
+ *  Cursors pointing at the stubs are moved to the new records.  Must be called with the partition
+ *  lock held.
+ *  @return the record in memory that replaced the stub, or an ERR_PTR()
+ */
+static struct tdl_record *tdl_refill(struct tdl_partition *part, struct tdl_record *stub)
+{
+   struct tdl_record *rec, *tmp, *full, *first = NULL;
+   struct tdl_cursor *cur;
+   size_t n = 0, off = 0;
+   loff_t pos = stub->spill_off;
+   char *batch;
+
+   rec = stub;
+   list_for_each_entry_from(rec, &part->records, node)
+   {
+      if (!rec->spilled || rec->spill_off != stub->spill_off + n || n + rec->len > SPILL_BATCH)
+      {
+         break;
+      }
+      n += rec->len;
+   }
+   // The stub starts the run: no record is empty and none is longer than SPILL_BATCH.  An empty
+   // run would come back as a spurious -ENOMEM below, so make it loud instead.
+   if (WARN_ON_ONCE(n == 0))
+   {
+      return ERR_PTR(-EIO);
+   }
+
+   batch = kvmalloc(n, GFP_KERNEL);
+   if (!batch)
+   {
+      return ERR_PTR(-ENOMEM);
+   }
+   if (kernel_read(part->spill_file, batch, n, &pos) != n)
+   {
+      kvfree(batch);
+      pr_warn_ratelimited("TDLChar: failed to read %zu bytes from a spill file\n", n);
+      return ERR_PTR(-EIO);
+   }
+
+   rec = stub;
+   list_for_each_entry_safe_from(rec, tmp, &part->records, node)
+   {
+      if (off == n)
+      {
+         break;
+      }
+      full = tdl_rec_alloc(part, rec->len, false);
+      if (!full)
+      {
+         break;                    // the rest stays spilled until it is needed
+      }
+      full->seq = rec->seq;
+      full->off = rec->off;
+      full->refilled = true;
+      memcpy(full->data, batch + off, rec->len);
+      off += rec->len;
+
+      list_replace(&rec->node, &full->node);
+      list_del(&rec->spill_node);
+      list_for_each_entry(cur, &part->cursors, node)
+      {
+         if (cur->next == rec)
+         {
+            cur->next = full;
+         }
+      }
+      part->spill_bytes -= full->len;
+      part->mem_bytes += full->len;
+      tdl_rec_free(part, rec);
+      if (!first)
+      {
+         first = full;
+      }
+   }
+   kvfree(batch);
+   atomic64_add(off, &tdl_refilled_total);
+   tdl_spill_reclaim(part);
+   return first ? first : ERR_PTR(-ENOMEM);
+}
+
+/** @brief Free the oldest records once every group has read them
+ *  Records are kept while no group exists at all, for the default group to read once it exists.
+ *  Must be called with the partition lock held.
+ *  @return true if any record was freed
+ */
+static bool tdl_trim(struct tdl_partition *part)
+{
+   struct tdl_record *rec, *tmp;
+   struct tdl_cursor *cur;
+   u64 min_seq = part->next_seq;
+   bool freed = false;
+
+   if (list_empty(&part->cursors))
+   {
+      return false;
+   }
+   list_for_each_entry(cur, &part->cursors, node)
+   {
+      min_seq = min(min_seq, cur->seq);
+   }
+   list_for_each_entry_safe(rec, tmp, &part->records, node)
+   {
+      if (rec->seq >= min_seq)
+      {
+         break;
+      }
+      list_del(&rec->node);
+      part->depth--;
+      if (rec->spilled)
+      {
+         list_del(&rec->spill_node);
+         part->spill_bytes -= rec->len;
+      }
+      else
+      {
+         part->mem_bytes -= rec->len;
+      }
+      tdl_rec_free(part, rec);
+      freed = true;
+   }
+   tdl_spill_reclaim(part);
+   return freed;
+}
+
+/** @brief Hand a cursor to a member, or to nobody
+ *  Must be called with the group lock and the cursor's partition lock held.
+ */
+static void tdl_cursor_set_owner(struct tdl_cursor *cur, struct tdl_session *owner)
+{
+   if (cur->owner)
+   {
+      cur->owner->owned--;
+   }
+   WRITE_ONCE(cur->owner, owner);
+   if (owner)
+   {
+      owner->owned++;
+   }
+}
+
+/** @brief Hand a partition of a group to a member, or to nobody
+ *  Must be called with the group lock held.
+ */
+static void tdl_set_owner(struct tdl_group *group, unsigned int idx, struct tdl_session *owner)
+{
+   tdl_lock(&tdl_parts[idx].lock);
+   tdl_cursor_set_owner(&group->cursors[idx], owner);
+   tdl_unlock(&tdl_parts[idx].lock);
+}
+
+/** @brief Spread the partitions that aren't pinned evenly over the members that haven't pinned one
+ *  Assignments are sticky: a member only gives up partitions when it holds more than its share.
+ *  Must be called with the group lock held.
+ */
+static void tdl_rebalance(struct tdl_group *group)
+{
+   struct tdl_session *member, *least;
+   unsigned int i, nfree = 0, nparts = 0, share;
+
+   list_for_each_entry(member, &group->members, member)
+   {
+      if (member->bound < 0)
+      {
+         nfree++;
+      }
+   }
+   for (i = 0; i < partitions; i++)
+   {
+      if (!group->cursors[i].pinned)
+      {
+         nparts++;
+      }
+   }
+   share = nfree ? DIV_ROUND_UP(nparts, nfree) : 0;
+
+   // Take partitions away from members with more than their share and from pinned members
+   for (i = 0; i < partitions; i++)
+   {
+      struct tdl_cursor *cur = &group->cursors[i];
+      if (!cur->pinned && cur->owner && (cur->owner->bound >= 0 || cur->owner->owned > share))
+      {
+         tdl_set_owner(group, i, NULL);
+      }
+   }
+
+   // Give every unowned partition to the member with the fewest
+   for (i = 0; i < partitions; i++)
+   {
+      if (group->cursors[i].pinned || group->cursors[i].owner)
+      {
+         continue;
+      }
+      least = NULL;
+      list_for_each_entry(member, &group->members, member)
+      {
+         if (member->bound < 0 && (!least || member->owned < least->owned))
+         {
+            least = member;
+         }
+      }
+      if (!least)
+      {
+         break;
+      }
+      tdl_set_owner(group, i, least);
+   }
+   wake_up_interruptible(&group->readq);
+}
+
+/** @brief Find a group by name or create it.  The default group starts at the oldest record of
+ *  each partition, since records are kept for it while no group exists.  A new named group starts
+ *  after the last record, so it only reads what is written once it exists.
+ *  Must be called with tdl_groups_lock held.
+ */
+static struct tdl_group *tdl_group_get(const char *name)
+{
+   struct tdl_group *group;
+   unsigned int i;
+
+   list_for_each_entry(group, &tdl_groups, node)
+   {
+      if (!strcmp(group->name, name))
+      {
+         return group;
+      }
+   }
+
+   group = kzalloc(struct_size(group, cursors, partitions), GFP_KERNEL_ACCOUNT);
+   if (!group)
+   {
+      return NULL;
+   }
+   strscpy(group->name, name, sizeof(group->name));
+   tdl_lock_init(&group->lock, &tdl_group_lock_stats);
+   INIT_LIST_HEAD(&group->members);
+   init_waitqueue_head(&group->readq);
+   for (i = 0; i < partitions; i++)
+   {
+      struct tdl_partition *part = &tdl_parts[i];
+      struct tdl_cursor *cur = &group->cursors[i];
+
+      cur->group = group;
+      tdl_lock(&part->lock);
+      cur->next = name[0] ? NULL : list_first_entry_or_null(&part->records, struct tdl_record,
+                                                            node);
+      cur->seq = cur->next ? cur->next->seq : part->next_seq;
+      cur->off = cur->next ? cur->next->off : part->next_off;
+      list_add_tail(&cur->node, &part->cursors);
+      tdl_unlock(&part->lock);
+   }
+   list_add_tail(&group->node, &tdl_groups);
+   return group;
+}
+
+/** @brief Free a group that has no members left, releasing the records only it was holding */
+static void tdl_group_free(struct tdl_group *group)
+{
+   unsigned int i;
+
+   for (i = 0; i < partitions; i++)
+   {
+      struct tdl_partition *part = &tdl_parts[i];
+      bool freed;
+
+      tdl_lock(&part->lock);
+      list_del(&group->cursors[i].node);
+      freed = tdl_trim(part);
+      tdl_shm_begin(part);
+      tdl_shm_end(part);
+      tdl_unlock(&part->lock);
+      if (freed)
+      {
+         wake_up_interruptible(&part->writeq);
+      }
+   }
+   mutex_destroy(&group->lock.mutex);
+   kfree(group);
+}
+
+/** @brief Add a session to a consumer group and rebalance the group's partitions
+ *  @return 0 if successful, -EBUSY if the session is already in a different group
+ */
+static int tdl_join(struct tdl_session *session, const char *name)
+{
+   struct tdl_group *group;
+   int ret = 0;
+
+   tdl_lock(&session->lock);
+   if (session->group)
+   {
+      ret = strcmp(session->group->name, name) ? -EBUSY : 0;
+      tdl_unlock(&session->lock);
+      return ret;
+   }
+
+   tdl_lock(&tdl_groups_lock);
+   group = tdl_group_get(name);
+   if (!group)
+   {
+      ret = -ENOMEM;
+   }
+   else
+   {
+      tdl_lock(&group->lock);
+      list_add_tail(&session->member, &group->members);
+      group->nmembers++;
+      tdl_rebalance(group);
+      tdl_unlock(&group->lock);
+      smp_store_release(&session->group, group);   // readers see a fully set up group
+   }
+   tdl_unlock(&tdl_groups_lock);
+   tdl_unlock(&session->lock);
+   return ret;
+}
+
+/** @brief Remove a session from its group.  Its partitions go to the remaining members, which
+ *  continue from the group's cursors, so no record is lost.  The group is freed with its last
+ *  member.
+ */
+static void tdl_leave(struct tdl_session *session)
+{
+   struct tdl_group *group = session->group;
+   unsigned int i;
+   bool empty;
+
+   if (!group)
+   {
+      return;
+   }
+   tdl_lock(&tdl_groups_lock);
+   tdl_lock(&group->lock);
+   for (i = 0; i < partitions; i++)
+   {
+      if (group->cursors[i].owner == session)
+      {
+         group->cursors[i].pinned = false;
+         tdl_set_owner(group, i, NULL);
+      }
+   }
+   list_del(&session->member);
+   empty = --group->nmembers == 0;
+   if (empty)
+   {
+      list_del(&group->node);
+   }
+   else
+   {
+      tdl_rebalance(group);
+   }
+   tdl_unlock(&group->lock);
+   tdl_unlock(&tdl_groups_lock);
+
+   if (empty)
+   {
+      tdl_group_free(group);
+   }
+}
+
+/** @brief Get the session's group, joining the default group on first use */
+static struct tdl_group *tdl_session_group(struct tdl_session *session)
+{
+   struct tdl_group *group = smp_load_acquire(&session->group);
+
+   if (!group)
+   {
+      tdl_join(session, "");       // another thread may have joined a group first, that's fine
+      group = smp_load_acquire(&session->group);
+   }
+   return group;
+}
+
+/** @brief Check whether a cursor has records left to read */
+static bool tdl_cursor_pending(struct tdl_partition *part, struct tdl_cursor *cur)
+{
+   return READ_ONCE(cur->seq) != READ_ONCE(part->next_seq);
+}
+
+/** @brief Check whether an idle member may take a partition over from its owner
+ *  Unowned partitions can always be taken.  An owned one only when its backlog has reached
+ *  steal_backlog, it isn't pinned, its owner has another partition to keep busy with, and no record
+ *  is half read.  Called under rcu_read_lock() or with the group lock held.
+ */
+static bool tdl_stealable(struct tdl_session *session, unsigned int idx)
+{
+   struct tdl_cursor *cur = &session->group->cursors[idx];
+   struct tdl_session *owner = READ_ONCE(cur->owner);
+   struct tdl_partition *part = &tdl_parts[idx];
+
+   if (session->bound >= 0 || owner == session || READ_ONCE(cur->pinned) ||
+       !tdl_cursor_pending(part, cur))
+   {
+      return false;
+   }
+   if (!owner)
+   {
+      return true;
+   }
+   return steal_backlog && READ_ONCE(owner->owned) > 1 && READ_ONCE(cur->pos) == 0 &&
+          READ_ONCE(part->next_seq) - READ_ONCE(cur->seq) >= steal_backlog;
+}
+
+/** @brief Check, without locking, whether a member has a record to read or a partition to take */
+static bool tdl_readable(struct tdl_session *session)
+{
+   struct tdl_group *group = session->group;
+   bool ready = false;
+   unsigned int i;
+
+   rcu_read_lock();                         // owners are only dereferenced under RCU
+   for (i = 0; i < partitions && !ready; i++)
+   {
+      struct tdl_cursor *cur = &group->cursors[i];
+      ready = (READ_ONCE(cur->owner) == session && tdl_cursor_pending(&tdl_parts[i], cur)) ||
+              tdl_stealable(session, i);
+   }
+   rcu_read_unlock();
+   return ready;
+}
+
+/** @brief Find the partition with the deepest backlog a member could take over.  Called with
+ *  the group locked or under RCU, since the owners are looked at.
+ *  @return its index, or -1 if there is none
+ */
+static int tdl_steal_target(struct tdl_session *session)
+{
+   struct tdl_group *group = session->group;
+   unsigned int i;
+   u64 lag, best_lag = 0;
+   int best = -1;
+
+   for (i = 0; i < partitions; i++)
+   {
+      if (tdl_stealable(session, i))
+      {
+         lag = READ_ONCE(tdl_parts[i].next_seq) - READ_ONCE(group->cursors[i].seq);
+         if (lag > best_lag)
+         {
+            best = i;
+            best_lag = lag;
+         }
+      }
+   }
+   return best;
+}
+
+/** @brief Take over the partition with the deepest backlog from a busier member
+ *  @return true if a partition was taken
+ */
+static bool tdl_steal(struct tdl_session *session)
+{
+   struct tdl_group *group = session->group;
+   struct tdl_cursor *cur;
+   bool stolen = false;
+   int best;
+
+   tdl_lock(&group->lock);
+   best = tdl_steal_target(session);
+   if (best >= 0)
+   {
+      cur = &group->cursors[best];
+      tdl_lock(&tdl_parts[best].lock);
+      // tdl_stealable() looked without the lock: if the owner has started on a record since, the
+      // rest of it is still the owner's to read
+      if (!cur->owner || cur->pos == 0)
+      {
+         tdl_cursor_set_owner(cur, session);
+         stolen = true;
+      }
+      tdl_unlock(&tdl_parts[best].lock);
+   }
+   tdl_unlock(&group->lock);
+   return stolen;
+}
+
+/** @brief Find a partition this member owns that has a record for it, and lock it
+ *  The member starts at the partition it last read from so it drains one partition in order
+ *  before moving on to the next.
+ *  @return the locked partition, or NULL if there is nothing to read
+ */
+static struct tdl_partition *tdl_lock_readable(struct tdl_session *session,
+                                               struct tdl_cursor **curp)
+{
+   struct tdl_group *group = session->group;
+   struct tdl_partition *part;
+   struct tdl_cursor *cur;
+   unsigned int i, idx;
+
+   for (i = 0; i < partitions; i++)
+   {
+      idx = (session->cursor + i) % partitions;
+      part = &tdl_parts[idx];
+      cur = &group->cursors[idx];
+      if (READ_ONCE(cur->owner) != session || !tdl_cursor_pending(part, cur))
+      {
+         continue;
+      }
+      tdl_lock(&part->lock);
+      if (cur->owner == session && cur->next)
+      {
+         session->cursor = idx;
+         *curp = cur;
+         return part;
+      }
+      tdl_unlock(&part->lock);
+   }
+   return NULL;
+}
+
+/** @brief Sends count bytes of a record, from pos, to where a read wants them
+ *  @return the number of bytes sent, which may be fewer, or a negative errno
+ */
+typedef ssize_t (*tdl_read_actor)(struct tdl_record *rec, size_t pos, size_t count, void *dest);
+
+/** @brief Send (part of) the next record of one of this reader's partitions to actor.  This is
+ *  dev_read(), dev_splice_read() and TDLCHAR_IOC_PEEK but for where the bytes go.
+ *  @param nonblock Fail with EAGAIN instead of waiting for a record
+ *  @param peek Leave the record to be read again, and out of the read statistics
+ *  @return the number of bytes sent
+ */
+static ssize_t tdl_read(struct file *filep, size_t len, bool nonblock, bool peek,
+                        tdl_read_actor actor, void *dest)
+{
+   struct tdl_session *session = filep->private_data;
+   struct tdl_group *group;
+   struct tdl_partition *part;
+   struct tdl_cursor *cur;
+   struct tdl_record *rec;
+   struct tdl_op_timer timer;
+   struct tdlchar_shm_part *shm;
+   size_t count;
+   ssize_t sent;
+   bool freed = false;
+   u64 blocked;
+   int ret;
+
+   if (len == 0)
+   {
+      return 0;
+   }
+   tdl_timer_start(&timer, TDL_OP_READ);
+   group = tdl_session_group(session);
+   if (!group)
+   {
+      return -ENOMEM;
+   }
+
+   while (!(part = tdl_lock_readable(session, &cur)))
+   {
+      if (tdl_steal(session))
+      {
+         continue;                    // took over a busier member's partition, read from it
+      }
+      if (nonblock)
+      {
+         return -EAGAIN;
+      }
+      blocked = ktime_get_ns();
+      ret = wait_event_interruptible(group->readq, tdl_readable(session));
+      atomic64_add(ktime_get_ns() - blocked, &session->blocked_ns);
+      if (ret)
+      {
+         return -ERESTARTSYS;         // interrupted by a signal
+      }
+   }
+
+   tdl_timer_phase(&timer, TDL_PHASE_WAIT);
+
+   rec = cur->next;
+   if (rec->spilled)
+   {
+      rec = tdl_refill(part, rec);
+      if (IS_ERR(rec))
+      {
+         tdl_unlock(&part->lock);
+         return PTR_ERR(rec);
+      }
+      tdl_timer_phase(&timer, TDL_PHASE_QUEUE);
+   }
+   sent = actor(rec, cur->pos, min(len, rec->len - cur->pos), dest);
+   if (sent < 0)
+   {
+      tdl_unlock(&part->lock);
+      return sent;
+   }
+   count = sent;
+   if (peek)
+   {
+      tdl_unlock(&part->lock);
+      return count;
+   }
+   tdl_timer_phase(&timer, TDL_PHASE_COPY);
+
+   // A short read leaves the remainder of the record for the next read by this group
+   cur->pos += count;
+   WRITE_ONCE(cur->off, cur->off + count);
+   if (cur->pos == rec->len)
+   {
+      cur->next = list_is_last(&rec->node, &part->records) ? NULL : list_next_entry(rec, node);
+      WRITE_ONCE(cur->seq, cur->seq + 1);
+      WRITE_ONCE(cur->pos, 0);
+      freed = tdl_trim(part);
+   }
+   shm = tdl_shm_begin(part);
+   shm->reads++;
+   shm->bytes_out += count;
+   tdl_shm_end(part);
+   tdl_unlock(&part->lock);
+
+   if (freed)
+   {
+      wake_up_interruptible(&part->writeq);
+   }
+   tdl_timer_end(&timer, TDL_OP_READ, TDL_PHASE_QUEUE, count);
+   atomic64_inc(&session->reads);
+   atomic64_add(count, &session->bytes_out);
+   pr_debug("TDLChar: Sent %zu characters to the user\n", count);
+   return count;
+}
+
+/** @brief The tdl_read_actor of dev_read()
+ *  In deterministic mode page faults are not served here, with the partition locked: dev_read()
+ *  faulted the buffer in, and if a page has gone again the read is short, or fails with EFAULT
+ *  for dev_read() to fault it in and retry.
+ */
+static ssize_t tdl_copy_to_user(struct tdl_record *rec, size_t pos, size_t count, void *dest)
+{
+   size_t left;
+
+   if (deterministic)
+   {
+      pagefault_disable();
+      left = __copy_to_user_inatomic((char __user *)dest, rec->data + pos, count);
+      pagefault_enable();
+      return left < count ? count - left : -EFAULT;
+   }
+
+   // copy_to_user has the format ( * to, *from, size) and returns 0 on success
+   if (copy_to_user((char __user *)dest, rec->data + pos, count))
+   {
+      printk(KERN_INFO "TDLChar: Failed to send %zu characters to the user\n", count);
+      return -EFAULT;              // Failed -- return a bad address message (i.e. -14)
+   }
+   return count;
+}
+
+/** @brief tdl_read() into the user buffer at buffer.  In deterministic mode the buffer is faulted
+ *  in first, up to the largest record, and once more if the copy finds a page gone, so that no
+ *  page fault is served with the partition locked and the work is bounded by the record size.
+ */
+static ssize_t tdl_read_user(struct file *filep, char __user *buffer, size_t len, bool peek,
+                             tdl_read_actor actor, void *dest)
+{
+   bool nonblock = filep->f_flags & O_NONBLOCK;
+   size_t window, missing;
+   unsigned int tries;
+   ssize_t ret;
+
+   if (!deterministic)
+   {
+      return tdl_read(filep, len, nonblock, peek, actor, dest);
+   }
+   // A read returns at most one record, so only that much of the buffer is faulted in, and the
+   // read is cut short where the buffer stops being writable
+   len = min_t(size_t, len, MESSAGE_LENGTH);
+   for (tries = 0; tries < 2; tries++)
+   {
+      missing = len ? fault_in_writeable(buffer, len) : 0;
+      window = len - missing;
+      if (len && !window)
+      {
+         return -EFAULT;           // not even the first byte can be written
+      }
+      ret = tdl_read(filep, window, nonblock, peek, actor, dest);
+      if (ret != -EFAULT || fatal_signal_pending(current))
+      {
+         return ret;
+      }
+   }
+   // Another thread keeps unmapping or protecting the buffer under us
+   return -EFAULT;
+}
+
+/** @brief The tdl_read_actor of TDLCHAR_IOC_PEEK: tdl_copy_to_user() to the peek's buffer, and
+ *  describe the record in the peek
+ */
+static ssize_t tdl_peek_to_user(struct tdl_record *rec, size_t pos, size_t count, void *dest)
+{
+   struct tdlchar_peek *peek = dest;
+
+   peek->seq = rec->seq;
+   peek->size = rec->len - pos;
+   return tdl_copy_to_user(rec, pos, count, u64_to_user_ptr(peek->buf));
+}
+
+/** @brief This function is called whenever device is being read from user space i.e. data is
+ *  being sent from the device to the user. In this case is uses the copy_to_user() function to
+ *  send the next record of one of this reader's partitions to the user and captures any errors.
+ *
+ *  The reader joins the default consumer group on its first read if it hasn't joined one.  The
+ *  read blocks until a record is available unless the device was opened with O_NONBLOCK.
+ *  @param filep A pointer to a file object (defined in linux/fs.h)
+ *  @param buffer The pointer to the buffer to which this function writes the data
+ *  @param len The length of the b
+ *  @param offset The offset if required
+ *  @return the number of bytes copied to the user
+ */
+static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
+{
+   return tdl_read_user(filep, buffer, len, false, tdl_copy_to_user, buffer);
+}
+
+/** @brief Apply the current transform table to a record in place */
+static void tdl_transform(char *data, size_t len)
+{
+   const struct tdl_xform *xf;
+
+   rcu_read_lock();
+   xf = rcu_dereference(tdl_xform);
+   if (xf->mode != TDL_XFORM_NONE)
+   {
+      tdl_xform_apply(xf->lut, data, len);
+   }
+   rcu_read_unlock();
+}
+
+
+/** @brief Transform a new record and queue it on the writer's partition.  This is dev_write(),
+ *  dev_splice_write() and tdl_ring_drain() once the bytes are in the record.  The record is freed
+ *  if it can't be queued.
+ *  @param session The writer, for its statistics
+ *  @param nonblock Fail with EAGAIN instead of waiting while the partition is full
+ *  @return the number of bytes queued
+ */
+static ssize_t tdl_write(struct tdl_session *session, bool nonblock, struct tdl_partition *part,
+                         struct tdl_record *rec, struct tdl_op_timer *timer)
+{
+   struct tdlchar_shm_part *shm;
+   struct tdl_cursor *cur;
+   struct sk_buff *skb;
+   size_t len = rec->len;
+   u64 blocked, *skb_seq;
+   int ret;
+
+   // Transform the record in place, before taking the partition lock.  This is binary safe --
+   // rec->len counts the bytes, no terminating null is needed.
+   ret = tdl_bpf_transform(part, rec->data, len);
+   if (ret < 0)
+   {
+      tdl_rec_free(part, rec);
+      return ret;
+   }
+   if (ret == 0)
+   {
+      tdl_transform(rec->data, len);
+   }
+   skb = tdl_genl_prepare(part, rec->data, len, &skb_seq);
+   tdl_timer_phase(timer, TDL_PHASE_COPY);
+
+   tdl_lock(&part->lock);
+   while (part->depth >= READ_ONCE(queue_depth))
+   {
+      tdl_unlock(&part->lock);
+      if (nonblock)
+      {
+         tdl_rec_free(part, rec);
+         nlmsg_free(skb);
+         atomic64_inc(&session->dropped);
+         return -EAGAIN;
+      }
+      blocked = ktime_get_ns();
+      ret = wait_event_interruptible(part->writeq,
+                                     READ_ONCE(part->depth) < READ_ONCE(queue_depth));
+      atomic64_add(ktime_get_ns() - blocked, &session->blocked_ns);
+      if (ret)
+      {
+         tdl_rec_free(part, rec);
+         nlmsg_free(skb);
+         atomic64_inc(&session->dropped);
+         return -ERESTARTSYS;
+      }
+      tdl_lock(&part->lock);
+   }
+   tdl_timer_phase(timer, TDL_PHASE_WAIT);
+   rec->seq = part->next_seq;
+   rec->off = part->next_off;
+   list_add_tail(&rec->node, &part->records);
+   part->depth++;
+   WRITE_ONCE(part->next_seq, part->next_seq + 1);
+   WRITE_ONCE(part->next_off, part->next_off + len);
+
+   // Groups that had read everything now have this record next
+   list_for_each_entry(cur, &part->cursors, node)
+   {
+      if (!cur->next)
+      {
+         cur->next = rec;
+      }
+      wake_up_interruptible(&cur->group->readq);
+   }
+   part->mem_bytes += len;
+
+   // Multicast under the lock so subscribers see a partition's records in order
+   if (skb)
+   {
+      *skb_seq = rec->seq;
+      genlmsg_multicast(&tdl_genl_family, skb, 0, 0, GFP_KERNEL);
+   }
+   tdl_spill(part);                // a deep backlog moves to the spill file
+   shm = tdl_shm_begin(part);
+   shm->writes++;
+   shm->bytes_in += len;
+   tdl_shm_end(part);
+   tdl_unlock(&part->lock);
+   tdl_timer_end(timer, TDL_OP_WRITE, TDL_PHASE_QUEUE, len);
+   atomic64_inc(&session->writes);
+   atomic64_add(len, &session->bytes_in);
+   pr_debug("TDLChar: Received %zu characters from the user\n", len);
+   return len;
+}
+
+/** @brief This function is called whenever the device is being written to from user space i.e.
+ *  data is sent to the device from the user. The data is copied into a new record, transformed
+ *  (by default converted to all uppercase) and queued on the writer's partition.
+ *
+ *  At most MESSAGE_LENGTH bytes are accepted per call; a larger write is short.  The write blocks
+ *  while the partition is full unless the device was opened with O_NONBLOCK.
+ *  @param filep A pointer to a file object
+ *  @param buffer The buffer to that contains the string to write to the device
+ *  @param len The length of the array of data that is being passed in the const char buffer
+ *  @param offset The offset if required
+ */
+static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset)
+{
+   struct tdl_partition *part = tdl_write_partition(filep);
+   struct tdl_record *rec;
+   struct tdl_op_timer timer;
+
+   len = min(len, (size_t)MESSAGE_LENGTH);
+   if (len == 0)
+   {
+      return 0;
+   }
+   tdl_timer_start(&timer, TDL_OP_WRITE);
+
+   rec = tdl_rec_alloc(part, len, false);
+   if (!rec)
+   {
+      return -ENOMEM;
+   }
+
+   // The buffer is a user-space pointer so it has to be copied in before it can be touched
+   if (copy_from_user(rec->data, buffer, len))
+   {
+      tdl_rec_free(part, rec);
+      return -EFAULT;
+   }
+   return tdl_write(filep->private_data, filep->f_flags & O_NONBLOCK, part, rec, &timer);
+}
+
+/** @brief Queue a record from any context but NMI; see tdlchar_api.h
+ *  The record is copied into this CPU's ring with interrupts off, so nothing else on the CPU can
+ *  get at the ring meanwhile and no lock is needed.  Moving it on to its partition takes locks
+ *  and memory and may sleep, so that is left to tdl_ring_drain().  The work item is queued from
+ *  an irq_work rather than here, since the caller may hold scheduler or timer locks that
+ *  queue_work() would take again.
+ */
+int tdlchar_enqueue(const void *key, size_t key_len, const void *data, size_t len)
+{
+   struct tdl_ring_slot *slot;
+   struct tdl_ring *ring;
+   unsigned long flags;
+   unsigned int head;
+
+   if (!ring_slots)
+   {
+      return -EOPNOTSUPP;
+   }
+   if (len == 0 || len > TDLCHAR_ENQUEUE_MAX || key_len > TDLCHAR_KEY_MAX)
+   {
+      return -EINVAL;
+   }
+
+   local_irq_save(flags);
+   ring = this_cpu_ptr(&tdl_rings);
+   head = ring->head;
+   if (head - smp_load_acquire(&ring->tail) >= ring_slots)
+   {
+      local_irq_restore(flags);
+      atomic64_inc(&tdl_ring_dropped);
+      return -ENOSPC;
+   }
+   slot = &ring->slots[head & (ring_slots - 1)];
+   // Same hash as a write with this key set; without a key each CPU's records stay in order
+   slot->hash = key && key_len ? jhash(key, key_len, 0) : hash_32(smp_processor_id(), 32);
+   slot->len = len;
+   memcpy(slot->data, data, len);
+   smp_store_release(&ring->head, head + 1);   // publish the slot to tdl_ring_drain()
+   irq_work_queue(&tdl_ring_irq_work);         // a no-op while it is already pending
+   local_irq_restore(flags);
+   return 0;
+}
+EXPORT_SYMBOL_GPL(tdlchar_enqueue);
+
+/** @brief The irq_work of tdlchar_enqueue(): runs in interrupt context with no locks held */
+static void tdl_ring_kick(struct irq_work *work)
+{
+   schedule_work(&tdl_ring_work);
+}
+
+/** @brief Move the records in every CPU's ring to their partitions and wake their readers
+ *  A work item never runs on two CPUs at once, so this is the only consumer of the rings.  Each
+ *  slot is copied into a new record and handed back before the record is queued, which never
+ *  waits: a record whose partition is full is dropped rather than holding up the other CPUs.
+ */
+static void tdl_ring_drain(struct work_struct *work)
+{
+   struct tdl_ring_slot *slot;
+   struct tdl_partition *part;
+   struct tdl_op_timer timer;
+   struct tdl_record *rec;
+   struct tdl_ring *ring;
+   unsigned int tail;
+   int cpu;
+
+   for_each_possible_cpu(cpu)
+   {
+      ring = per_cpu_ptr(&tdl_rings, cpu);
+      for (tail = ring->tail; tail != smp_load_acquire(&ring->head); tail++)
+      {
+         slot = &ring->slots[tail & (ring_slots - 1)];
+         part = &tdl_parts[reciprocal_scale(slot->hash, partitions)];
+         tdl_timer_start(&timer, TDL_OP_WRITE);
+         rec = tdl_rec_alloc(part, slot->len, false);
+         if (rec)
+         {
+            memcpy(rec->data, slot->data, slot->len);
+         }
+         smp_store_release(&ring->tail, tail + 1);   // the producer may reuse the slot
+         if (rec && tdl_write(&tdl_ring_session, true, part, rec, &timer) > 0)
+         {
+            atomic64_inc(&tdl_ring_queued);
+         }
+         else
+         {
+            atomic64_inc(&tdl_ring_dropped);
+         }
+      }
+      cond_resched();
+   }
+}
+
+// Pipe buffers that share the pages of a record (or hold a copy of it) and drop their reference
+// when the pipe is done with them.  They can't be stolen: the pages may still be queued for another
+// consumer group, or be part of a larger block.
+static const struct pipe_buf_operations tdl_pipe_buf_ops =
+{
+   .release = generic_pipe_buf_release,
+   .get     = generic_pipe_buf_get,
+};
+
+/** @brief The tdl_read_actor of dev_splice_read()
+ *  Records in a page block are not copied: the pipe takes references to the block's pages and
+ *  tdl_pages_put() leaves the block to the pipe if it is still there when the record is freed.
+ *  Other records are copied into new pages, one copy as with read().
+ */
+static ssize_t tdl_splice_to_pipe(struct tdl_record *rec, size_t pos, size_t count, void *dest)
+{
+   struct pipe_inode_info *pipe = dest;
+   struct pipe_buffer buf = { .ops = &tdl_pipe_buf_ops };
+   const char *from;
+   size_t sent = 0;
+   ssize_t ret = -EAGAIN;
+
+   while (sent < count && !pipe_full(pipe->head, pipe->tail, pipe->max_usage))
+   {
+      from = rec->data + pos + sent;
+      if (rec->page_order >= 0)
+      {
+         buf.page = virt_to_page(from);
+         buf.offset = offset_in_page(from);
+         buf.len = min_t(size_t, count - sent, PAGE_SIZE - buf.offset);
+         get_page(buf.page);
+      }
+      else
+      {
+         buf.page = alloc_page(GFP_KERNEL_ACCOUNT);
+         if (!buf.page)
+         {
+            ret = -ENOMEM;
+            break;
+         }
+         buf.offset = 0;
+         buf.len = min_t(size_t, count - sent, PAGE_SIZE);
+         memcpy(page_address(buf.page), from, buf.len);
+      }
+      ret = add_to_pipe(pipe, &buf);       // releases the page if it fails
+      if (ret < 0)
+      {
+         break;
+      }
+      sent += buf.len;
+   }
+   return sent ? sent : ret;
+}
+
+/** @brief Splice (part of) the next record into a pipe, as much of it as the pipe has room for
+ *  @return the number of bytes spliced
+ */
+static ssize_t dev_splice_read(struct file *filep, loff_t *ppos, struct pipe_inode_info *pipe,
+                               size_t len, unsigned int flags)
+{
+   return tdl_read(filep, len, (filep->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK),
+                   false, tdl_splice_to_pipe, pipe);
+}
+
+/** @brief Copy one pipe buffer into the record dev_splice_write() is filling */
+static int tdl_splice_from_pipe(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
+                                struct splice_desc *sd)
+{
+   struct tdl_record *rec = sd->u.data;
+   char *from = kmap_local_page(buf->page);
+
+   memcpy(rec->data + sd->num_spliced, from + buf->offset, sd->len);
+   kunmap_local(from);
+   return sd->len;
+}
+
+/** @brief Queue what is in a pipe, up to len bytes and at most MESSAGE_LENGTH, as one record
+ *  The pages in the pipe, gifted or not, are copied into the record once -- records keep their
+ *  bytes in one piece for the transform, spilling and netlink.
+ *  @return the number of bytes queued
+ */
+static ssize_t dev_splice_write(struct pipe_inode_info *pipe, struct file *filep, loff_t *ppos,
+                                size_t len, unsigned int flags)
+{
+   struct tdl_partition *part = tdl_write_partition(filep);
+   struct splice_desc sd =
+   {
+      .total_len = min(len, (size_t)MESSAGE_LENGTH),
+      .flags     = flags,
+      .pos       = *ppos,
+   };
+   struct tdl_op_timer timer;
+   struct tdl_record *rec;
+   size_t size;
+   ssize_t ret;
+
+   if (sd.total_len == 0)
+   {
+      return 0;
+   }
+   tdl_timer_start(&timer, TDL_OP_WRITE);
+
+   rec = tdl_rec_alloc(part, sd.total_len, false);
+   if (!rec)
+   {
+      return -ENOMEM;
+   }
+   sd.u.data = rec;
+   pipe_lock(pipe);
+   ret = __splice_from_pipe(pipe, &sd, tdl_splice_from_pipe);
+   pipe_unlock(pipe);
+   if (ret <= 0)
+   {
+      tdl_rec_free(part, rec);
+      return ret;
+   }
+
+   // The pipe held less than asked for, so the record is shorter than it was allocated for
+   size = tdl_rec_size(rec);
+   rec->len = ret;
+   tdl_account(part, (s64)tdl_rec_size(rec) - size);
+   return tdl_write(filep->private_data, filep->f_flags & O_NONBLOCK, part, rec, &timer);
+}
+
+/** @brief Map the statistics pages (struct tdlchar_shm) read-only into a process
+ *  @return 0, or EINVAL for a mapping at another offset or larger than the pages, or EPERM for a
+ *  writable one
+ */
+static int dev_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+   if (vma->vm_pgoff || vma->vm_end - vma->vm_start > tdl_shm_size)
+   {
+      return -EINVAL;
+   }
+   if (vma->vm_flags & VM_WRITE)
+   {
+      return -EPERM;
+   }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+   vm_flags_clear(vma, VM_MAYWRITE);      // mprotect() can't make it writable later either
+#else
+   vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+   return remap_vmalloc_range(vma, tdl_shm, 0);
+}
+
+/** @brief Report whether a read or write on this file would block
+ *  @param filep A pointer to a file object
+ *  @param wait The poll table to register our wait queues with
+ */
+static __poll_t dev_poll(struct file *filep, poll_table *wait)
+{
+   struct tdl_session *session = filep->private_data;
+   struct tdl_partition *part = tdl_write_partition(filep);
+   struct tdl_group *group = NULL;
+   __poll_t mask = 0;
+
+   // Only polling for input makes this file a reader, so writers don't get partitions assigned
+   if (poll_requested_events(wait) & (EPOLLIN | EPOLLRDNORM))
+   {
+      group = tdl_session_group(session);
+   }
+   if (group)
+   {
+      poll_wait(filep, &group->readq, wait);
+   }
+   poll_wait(filep, &part->writeq, wait);
+
+   if (group && tdl_readable(session))
+   {
+      mask |= EPOLLIN | EPOLLRDNORM;
+   }
+   if (READ_ONCE(part->depth) < READ_ONCE(queue_depth))
+   {
+      mask |= EPOLLOUT | EPOLLWRNORM;
+   }
+   return mask;
+}
+
+/** @brief Pin a partition to a member of its group, or unpin with -1
+ *  A pinned member reads only that partition and takes no part in automatic assignment.
+ *  @return 0 if successful, -EBUSY if another member already pinned the partition
+ */
+static int tdl_bind(struct tdl_session *session, int idx)
+{
+   struct tdl_group *group = tdl_session_group(session);
+   int ret = 0;
+
+   if (!group)
+   {
+      return -ENOMEM;
+   }
+   tdl_lock(&group->lock);
+   if (idx >= 0 && group->cursors[idx].pinned && group->cursors[idx].owner != session)
+   {
+      ret = -EBUSY;
+   }
+   else
+   {
+      if (session->bound >= 0)
+      {
+         group->cursors[session->bound].pinned = false;
+         tdl_set_owner(group, session->bound, NULL);
+      }
+      WRITE_ONCE(session->bound, idx);
+      if (idx >= 0)
+      {
+         tdl_set_owner(group, idx, session);
+         group->cursors[idx].pinned = true;
+      }
+      tdl_rebalance(group);
+   }
+   tdl_unlock(&group->lock);
+   return ret;
+}
+
+/** @brief Fill in the statistics of a file for TDLCHAR_IOC_GET_STATS.  The backlogs are read
+ *  without locks, so they are a snapshot that may be slightly stale.
+ *  @param size The size of the caller's struct tdlchar_stats, taken from the command
+ */
+static long tdl_get_stats(struct file *filep, void __user *argp, size_t size)
+{
+   struct tdl_session *session = filep->private_data;
+   struct tdl_group *group = READ_ONCE(session->group);
+   struct tdl_partition *part = tdl_write_partition(filep);
+   struct tdlchar_stats stats = { 0 };
+   unsigned int i;
+
+   if (size < offsetofend(struct tdlchar_stats, size))
+   {
+      return -EINVAL;
+   }
+   stats.version = TDLCHAR_STATS_VERSION;
+   stats.size = sizeof(stats);
+   stats.bytes_in = atomic64_read(&session->bytes_in);
+   stats.bytes_out = atomic64_read(&session->bytes_out);
+   stats.writes = atomic64_read(&session->writes);
+   stats.reads = atomic64_read(&session->reads);
+   stats.blocked_ns = atomic64_read(&session->blocked_ns);
+   stats.dropped = atomic64_read(&session->dropped);
+   stats.xform_calls = atomic64_read(&session->xform_calls);
+   stats.xform_bytes = atomic64_read(&session->xform_bytes);
+   stats.write_backlog = READ_ONCE(part->depth);
+   if (group)                       // a member's group lives at least as long as the member
+   {
+      for (i = 0; i < partitions; i++)
+      {
+         if (READ_ONCE(group->cursors[i].owner) == session)
+         {
+            stats.read_backlog += READ_ONCE(tdl_parts[i].next_seq) -
+                                  READ_ONCE(group->cursors[i].seq);
+         }
+      }
+   }
+
+   // Old callers get the start of the struct, newer ones get zeros past what we know about
+   if (size > sizeof(stats) && clear_user(argp + sizeof(stats), size - sizeof(stats)))
+   {
+      return -EFAULT;
+   }
+   return copy_to_user(argp, &stats, min(size, sizeof(stats))) ? -EFAULT : 0;
+}
+
+/** @brief Transform user buffers into other user buffers, for TDLCHAR_IOC_TRANSFORM(V)
+ *  Nothing is queued and no partition lock is taken.  Each piece of up to MESSAGE_LENGTH bytes goes
+ *  through the same stages as a record written to the device: a BPF program, then the table.
+ *  In deterministic mode a call stops after the first piece, so it takes a bounded time.
+ *  @return the number of bytes transformed, or a negative errno if there were none
+ */
+static long tdl_xform_user(struct file *filep, const struct tdlchar_xform *xf, u32 count)
+{
+   struct tdl_session *session = filep->private_data;
+   struct tdl_partition *part = tdl_write_partition(filep);
+   size_t chunk = MESSAGE_LENGTH, total = 0, done = 0, limit, off, n;
+   struct tdl_record *rec = NULL;
+   long ret = 0;
+   char *buf;
+   u32 i;
+
+   for (i = 0; i < count; i++)
+   {
+      if (xf[i].len > MAX_RW_COUNT - total)
+      {
+         return -EINVAL;                    // the result has to fit in the return value
+      }
+      total += xf[i].len;
+   }
+   // Deterministic mode does one chunk per call, in a pool buffer, and returns a short count
+   limit = deterministic ? min(total, chunk) : total;
+   if (deterministic)
+   {
+      rec = tdl_rec_alloc(part, limit, false);
+      buf = rec ? rec->data : NULL;
+   }
+   else
+   {
+      buf = kvmalloc(min(total, chunk), GFP_KERNEL);
+   }
+   if (!buf)
+   {
+      return -ENOMEM;
+   }
+
+   for (i = 0; i < count && !ret && done < limit; i++)
+   {
+      for (off = 0; off < xf[i].len && done < limit; off += n)
+      {
+         n = min_t(u64, xf[i].len - off, min(chunk, limit - done));
+         if (copy_from_user(buf, u64_to_user_ptr(xf[i].in) + off, n))
+         {
+            ret = -EFAULT;
+            break;
+         }
+         ret = tdl_bpf_transform(part, buf, n);
+         if (ret < 0)
+         {
+            break;
+         }
+         if (ret == 0)
+         {
+            tdl_transform(buf, n);
+         }
+         ret = 0;
+         if (copy_to_user(u64_to_user_ptr(xf[i].out) + off, buf, n))
+         {
+            ret = -EFAULT;
+            break;
+         }
+         done += n;
+         if (fatal_signal_pending(current))
+         {
+            ret = -EINTR;
+            break;
+         }
+         cond_resched();
+      }
+   }
+   if (rec)
+   {
+      tdl_rec_free(part, rec);
+   }
+   else
+   {
+      kvfree(buf);
+   }
+
+   atomic64_inc(&session->xform_calls);
+   atomic64_add(done, &session->xform_bytes);
+   return done ? done : ret;
+}
+
+/** @brief Count the bytes this reader's read()s can return without waiting, for FIONREAD: the
+ *  unread bytes of the partitions it owns.  Reads the counters without taking the locks, like
+ *  the backlogs of TDLCHAR_IOC_GET_STATS.
+ */
+static long tdl_fionread(struct tdl_session *session, int __user *argp)
+{
+   struct tdl_group *group = smp_load_acquire(&session->group);
+   u64 bytes = 0;
+   unsigned int i;
+
+   for (i = 0; i < partitions; i++)
+   {
+      if (!group)
+      {
+         // Not a reader yet, and asking doesn't make it one: report every queued byte
+         bytes += READ_ONCE(tdl_parts[i].mem_bytes) + READ_ONCE(tdl_parts[i].spill_bytes);
+      }
+      else if (READ_ONCE(group->cursors[i].owner) == session)
+      {
+         bytes += READ_ONCE(tdl_parts[i].next_off) - READ_ONCE(group->cursors[i].off);
+      }
+   }
+   return put_user((int)min_t(u64, bytes, INT_MAX), argp);
+}
+
+/** @brief Get the number of bytes the next read() returns if its buffer is large enough, or 0 if
+ *  it would block, for TDLCHAR_IOC_PEEK_SIZE.  When the member has nothing to read in its own
+ *  partitions this is the next record of the partition read() would take over, which is not
+ *  taken yet.  A file that has not joined a group gets 0 and stays out of the groups.
+ */
+static long tdl_peek_size(struct tdl_session *session, __u64 __user *argp)
+{
+   struct tdl_group *group = smp_load_acquire(&session->group);
+   struct tdl_partition *part;
+   struct tdl_cursor *cur;
+   u64 size = 0;
+   int idx;
+
+   if (!group)
+   {
+      return put_user(size, argp);
+   }
+   part = tdl_lock_readable(session, &cur);
+   if (!part)
+   {
+      rcu_read_lock();
+      idx = tdl_steal_target(session);
+      rcu_read_unlock();
+      if (idx >= 0)
+      {
+         part = &tdl_parts[idx];
+         cur = &group->cursors[idx];
+         tdl_lock(&part->lock);
+      }
+   }
+   if (part)
+   {
+      if (cur->next)
+      {
+         size = cur->next->len - cur->pos;  // a spilled record's stub knows its length
+      }
+      tdl_unlock(&part->lock);
+   }
+   return put_user(size, argp);
+}
+
+/** @brief Handle the TDLCHAR_IOC_* commands from tdlchar_ioctl.h
+ *  @param filep A pointer to a file object
+ *  @param cmd The ioctl command
+ *  @param arg The user-space pointer argument of the command
+ */
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+   struct tdl_session *session = filep->private_data;
+   void __user *argp = (void __user *)arg;
+
+   // The statistics struct grows over time, so any size of it is accepted
+   if (_IOC_TYPE(cmd) == TDLCHAR_IOC_MAGIC && _IOC_DIR(cmd) == _IOC_READ &&
+       _IOC_NR(cmd) == _IOC_NR(TDLCHAR_IOC_GET_STATS))
+   {
+      return tdl_get_stats(filep, argp, _IOC_SIZE(cmd));
+   }
+
+   switch (cmd)
+   {
+   case TDLCHAR_IOC_SET_KEY:
+   {
+      struct tdlchar_key key;
+      if (copy_from_user(&key, argp, sizeof(key)))
+      {
+         return -EFAULT;
+      }
+      if (key.len > TDLCHAR_KEY_MAX)
+      {
+         return -EINVAL;
+      }
+      session->key_hash = jhash(key.data, key.len, 0);
+      session->has_key = key.len > 0;
+      return tdl_write_partition(filep) - tdl_parts;   // tell the writer where its records go
+   }
+   case TDLCHAR_IOC_BIND:
+   {
+      __s32 part;
+      if (get_user(part, (__s32 __user *)argp))
+      {
+         return -EFAULT;
+      }
+      if (part < -1 || part >= (__s32)partitions)
+      {
+         return -EINVAL;
+      }
+      return tdl_bind(session, part);
+   }
+   case TDLCHAR_IOC_JOIN_GROUP:
+   {
+      struct tdlchar_group req;
+      if (copy_from_user(&req, argp, sizeof(req)))
+      {
+         return -EFAULT;
+      }
+      if (!memchr(req.name, '\0', sizeof(req.name)))
+      {
+         return -EINVAL;
+      }
+      return tdl_join(session, req.name);
+   }
+   case TDLCHAR_IOC_GET_PARTITIONS:
+      return put_user(partitions, (__u32 __user *)argp);
+   case FIONREAD:
+      return tdl_fionread(session, (int __user *)argp);
+   case TDLCHAR_IOC_PEEK_SIZE:
+      return tdl_peek_size(session, (__u64 __user *)argp);
+   case TDLCHAR_IOC_PEEK:
+   {
+      struct tdlchar_peek peek;
+      ssize_t ret;
+      if (copy_from_user(&peek, argp, sizeof(peek)))
+      {
+         return -EFAULT;
+      }
+      // One record is the most a peek copies, however large the buffer
+      ret = tdl_read_user(filep, u64_to_user_ptr(peek.buf),
+                          min_t(u64, peek.len, MESSAGE_LENGTH), true, tdl_peek_to_user, &peek);
+      if (ret > 0 && copy_to_user(argp, &peek, sizeof(peek)))
+      {
+         return -EFAULT;
+      }
+      return ret;
+   }
+   case TDLCHAR_IOC_TRANSFORM:
+   {
+      struct tdlchar_xform xf;
+      if (copy_from_user(&xf, argp, sizeof(xf)))
+      {
+         return -EFAULT;
+      }
+      return tdl_xform_user(filep, &xf, 1);
+   }
+   case TDLCHAR_IOC_TRANSFORMV:
+   {
+      struct tdlchar_xformv req;
+      struct tdlchar_xform *vec;
+      long ret;
+      if (copy_from_user(&req, argp, sizeof(req)))
+      {
+         return -EFAULT;
+      }
+      if (req.reserved || req.count == 0 || req.count > TDLCHAR_XFORM_MAX)
+      {
+         return -EINVAL;
+      }
+      vec = memdup_user(u64_to_user_ptr(req.vec), req.count * sizeof(*vec));
+      if (IS_ERR(vec))
+      {
+         return PTR_ERR(vec);
+      }
+      ret = tdl_xform_user(filep, vec, req.count);
+      kfree(vec);
+      return ret;
+   }
+   default:
+      return -ENOTTY;
+   }
+}
+
+/** @brief The device release function that is called whenever the device is closed/released by
+ *  the userspace program
+ *  @param inodep A pointer to an inode object (defined in linux/fs.h)
+ *  @param filep A pointer to a file object (defined in linux/fs.h)
+ */
+static int dev_release(struct inode *inodep, struct file *filep)
+{
+   struct tdl_session *session = filep->private_data;
+
+   tdl_leave(session);
+   mutex_destroy(&session->lock.mutex);
+   kfree_rcu(session, rcu);        // tdl_readable() may still be looking at it
 
-   printk(KERN_INFO "TDLChar: Device successfully closed\n");
+   tdl_printk(KERN_INFO "TDLChar: Device successfully closed\n");
    return 0;
 }
 
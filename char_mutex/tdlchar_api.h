@@ -0,0 +1,30 @@
+/**
+ * @file   tdlchar_api.h
+ * @author Todd Leonhardt
+ * @date   18 Oct 2026
+ * @version 1.0
+ * @brief  The in-kernel interface of the tdlchar LKM, for other modules that feed records to
+ * /dev/tdlchar.  Unlike tdlchar_ioctl.h this header is for kernel code only.
+ */
+#ifndef TDLCHAR_API_H
+#define TDLCHAR_API_H
+
+#include <linux/types.h>
+
+#define TDLCHAR_ENQUEUE_MAX 248         ///< Longest record tdlchar_enqueue() takes
+
+/** @brief Queue a record from any context but NMI, including hard and soft interrupts and code
+ *  that holds spinlocks.  The record is copied into a slot of this CPU's ring in constant time;
+ *  a work item moves it to its partition shortly after and wakes the readers.  Records with the
+ *  same key go to the same partition as records written with that key by TDLCHAR_IOC_SET_KEY.
+ *  Records without a key are kept in order per CPU.
+ *  @param key The partitioning key, or NULL
+ *  @param key_len Bytes in key, up to TDLCHAR_KEY_MAX
+ *  @param data The record
+ *  @param len Bytes in data, 1 to TDLCHAR_ENQUEUE_MAX
+ *  @return 0, EINVAL for a bad length, ENOSPC if this CPU's ring is full, or EOPNOTSUPP if the
+ *  module was loaded with ring_slots=0
+ */
+int tdlchar_enqueue(const void *key, size_t key_len, const void *data, size_t len);
+
+#endif /* TDLCHAR_API_H */
@@ -0,0 +1,41 @@
+/**
+ * @file   tdlchar_genl.h
+ * @author Todd Leonhardt
+ * @date   18 Oct 2026
+ * @version 1.0
+ * @brief  The generic netlink interface of the tdlchar LKM.  Programs that join the "records"
+ * multicast group of the "tdlchar" family get a copy of every record written to /dev/tdlchar,
+ * after it has been transformed, without reading the device.  Like tdlchar_ioctl.h this header is
+ * shared with user space, so it may only use types from linux/types.h.
+ */
+#ifndef TDLCHAR_GENL_H
+#define TDLCHAR_GENL_H
+
+#include <linux/types.h>
+
+#define TDLCHAR_GENL_NAME    "tdlchar"  ///< The generic netlink family name
+#define TDLCHAR_GENL_VERSION 1          ///< Version of the family this header describes
+#define TDLCHAR_GENL_MCGRP   "records"  ///< The multicast group records are sent to
+
+/** @brief Commands of the tdlchar family */
+enum
+{
+   TDLCHAR_CMD_UNSPEC,
+   TDLCHAR_CMD_RECORD,                  ///< A record was queued; sent to TDLCHAR_GENL_MCGRP
+   __TDLCHAR_CMD_MAX,
+};
+#define TDLCHAR_CMD_MAX (__TDLCHAR_CMD_MAX - 1)
+
+/** @brief Attributes of a TDLCHAR_CMD_RECORD message */
+enum
+{
+   TDLCHAR_A_UNSPEC,
+   TDLCHAR_A_PARTITION,                 ///< __u32: partition the record was queued in
+   TDLCHAR_A_SEQ,                       ///< __u64: its sequence number in that partition
+   TDLCHAR_A_DATA,                      ///< binary: the transformed record
+   TDLCHAR_A_PAD,                       ///< Aligns TDLCHAR_A_SEQ, never sent on its own
+   __TDLCHAR_A_MAX,
+};
+#define TDLCHAR_A_MAX (__TDLCHAR_A_MAX - 1)
+
+#endif /* TDLCHAR_GENL_H */
@@ -0,0 +1,167 @@
+/**
+ * @file   tdlchar_ioctl.h
+ * @author Todd Leonhardt
+ * @date   18 Oct 2026
+ * @version 1.0
+ * @brief  The ioctl interface of the tdlchar LKM, and the layout of the statistics pages that can
+ * be mmap()ed from /dev/tdlchar.  This header is shared by the LKM (tdlchar.c) and the user space
+ * programs that talk to /dev/tdlchar, so it may only use types from linux/types.h and macros from
+ * linux/ioctl.h.
+ */
+#ifndef TDLCHAR_IOCTL_H
+#define TDLCHAR_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define TDLCHAR_IOC_MAGIC  0xD1         ///< The ioctl "type" byte used by every tdlchar command
+#define TDLCHAR_KEY_MAX    64           ///< Longest key a writer can attach to its records
+#define TDLCHAR_GROUP_MAX  32           ///< Longest consumer group name, including the null
+#define TDLCHAR_STATS_VERSION 2         ///< Version of struct tdlchar_stats this header describes
+#define TDLCHAR_XFORM_MAX  1024         ///< Most buffers one TDLCHAR_IOC_TRANSFORMV takes
+#define TDLCHAR_SHM_VERSION 1           ///< Version of struct tdlchar_shm this header describes
+#define TDLCHAR_SHM_BUCKETS 32          ///< log2 latency buckets in struct tdlchar_shm
+
+/** @brief A partitioning key, e.g. a session id.  Records written after the key is set are hashed
+ *  by it to a partition, so records that share a key are read back in the order written.
+ */
+struct tdlchar_key
+{
+   __u32 len;                           ///< Number of bytes used in data, 0 clears the key
+   __u8  data[TDLCHAR_KEY_MAX];         ///< The key bytes -- need not be null terminated
+};
+
+/** @brief A consumer group to join.  Every group sees every record; within a group each record is
+ *  read by exactly one member.  The empty name is the default group that readers join
+ *  automatically on their first read.
+ */
+struct tdlchar_group
+{
+   char name[TDLCHAR_GROUP_MAX];        ///< Null-terminated group name
+};
+
+/** @brief Usage statistics of one open file, for applications that tune themselves from their own
+ *  throughput.  New fields are only ever added at the end: the kernel fills in as much of the
+ *  struct as the caller's TDLCHAR_IOC_GET_STATS asks for and reports the version and size it
+ *  knows, so old binaries keep working with newer modules and the other way around.
+ */
+struct tdlchar_stats
+{
+   __u32 version;                       ///< TDLCHAR_STATS_VERSION of the module
+   __u32 size;                          ///< sizeof(struct tdlchar_stats) in the module
+   __u64 bytes_in;                      ///< Bytes written
+   __u64 bytes_out;                     ///< Bytes read
+   __u64 writes;                        ///< Successful write() calls
+   __u64 reads;                         ///< Successful read() calls
+   __u64 blocked_ns;                    ///< Time spent blocked waiting for records or queue space
+   __u64 dropped;                       ///< Writes that queued nothing: queue full with
+                                        ///< O_NONBLOCK, or interrupted while waiting
+   __u64 read_backlog;                  ///< Unread records in the partitions this fd reads
+   __u64 write_backlog;                 ///< Records queued in the partition this fd writes to
+   __u64 xform_calls;                   ///< TDLCHAR_IOC_TRANSFORM(V) calls (version 2)
+   __u64 xform_bytes;                   ///< Bytes they transformed (version 2)
+};
+
+/** @brief A buffer to transform with TDLCHAR_IOC_TRANSFORM, or one entry of the vector passed to
+ *  TDLCHAR_IOC_TRANSFORMV.  The len bytes at in are transformed as if they had been written to
+ *  the device and read back, and stored at out, which may be the same as in.
+ */
+struct tdlchar_xform
+{
+   __u64 in;                            ///< User pointer to the input
+   __u64 out;                           ///< User pointer to where the output goes
+   __u64 len;                           ///< Bytes to transform
+};
+
+/** @brief A vector of buffers to transform with one TDLCHAR_IOC_TRANSFORMV */
+struct tdlchar_xformv
+{
+   __u64 vec;                           ///< User pointer to count struct tdlchar_xform
+   __u32 count;                         ///< Up to TDLCHAR_XFORM_MAX
+   __u32 reserved;                      ///< Must be 0
+};
+
+/** @brief A look at the next record a read() would return, with TDLCHAR_IOC_PEEK */
+struct tdlchar_peek
+{
+   __u64 buf;                           ///< User pointer to copy the record to
+   __u64 len;                           ///< Size of buf
+   __u64 seq;                           ///< Out: sequence number of the record in its partition
+   __u64 size;                          ///< Out: bytes of it the next read() returns, the whole
+                                        ///< record unless a short read took some already
+};
+
+/** @brief The counters of one partition in the statistics pages.  The module changes them in place
+ *  under the partition's lock.  seq is odd while it does; to read a consistent set, read seq, retry
+ *  while it is odd, read the counters, and retry if seq has changed since (with read barriers in
+ *  between).  One entry fills a 64-byte cache line.
+ */
+struct tdlchar_shm_part
+{
+   __u32 seq;                           ///< Odd while the entry is being updated
+   __u32 reserved;
+   __u64 writes;                        ///< Records queued
+   __u64 reads;                         ///< Successful read() and splice() calls
+   __u64 bytes_in;                      ///< Bytes queued
+   __u64 bytes_out;                     ///< Bytes read
+   __u64 depth;                         ///< Records queued and not yet read by every group
+   __u64 mem_bytes;                     ///< Bytes of queued records held in memory
+   __u64 spill_bytes;                   ///< ... and in the spill file
+};
+
+/** @brief The statistics pages, mapped read-only with mmap() at offset 0 of /dev/tdlchar.  A
+ *  monitor can sample them with plain loads, without system calls.  The mapping may be up to the
+ *  size rounded up to whole pages.
+ */
+struct tdlchar_shm
+{
+   __u32 version;                       ///< TDLCHAR_SHM_VERSION of the module
+   __u32 size;                          ///< Bytes in use, including the part[] array
+   __u32 partitions;                    ///< Entries in part[]
+   __u32 buckets;                       ///< Entries in write_ns[] and read_ns[]
+   __u64 reserved[6];
+   __u64 write_ns[TDLCHAR_SHM_BUCKETS]; ///< Writes that took [2^i, 2^(i+1)) ns, the last bucket
+                                        ///< counts everything longer.  Each is updated atomically.
+   __u64 read_ns[TDLCHAR_SHM_BUCKETS];  ///< The same for reads
+   struct tdlchar_shm_part part[];      ///< One per partition
+};
+
+/** Set the key for records written on this fd.  Returns the partition the key maps to. */
+#define TDLCHAR_IOC_SET_KEY        _IOW(TDLCHAR_IOC_MAGIC, 1, struct tdlchar_key)
+
+/** Pin the given partition to this fd within its group, or return to automatic assignment when -1.
+ *  Fails with EBUSY if another member of the group has already pinned the partition. */
+#define TDLCHAR_IOC_BIND           _IOW(TDLCHAR_IOC_MAGIC, 2, __s32)
+
+/** Get the number of partitions the device was loaded with. */
+#define TDLCHAR_IOC_GET_PARTITIONS _IOR(TDLCHAR_IOC_MAGIC, 3, __u32)
+
+/** Join a consumer group.  Must be done before the first read; fails with EBUSY afterwards. */
+#define TDLCHAR_IOC_JOIN_GROUP     _IOW(TDLCHAR_IOC_MAGIC, 4, struct tdlchar_group)
+
+/** Get the statistics of this fd.  The size encoded in the command may differ from this header's
+ *  struct tdlchar_stats as long as it covers version and size. */
+#define TDLCHAR_IOC_GET_STATS      _IOR(TDLCHAR_IOC_MAGIC, 5, struct tdlchar_stats)
+
+/** Transform a buffer without queueing anything: one call instead of a write() and a read().
+ *  Returns the number of bytes transformed; it is only short if a fault or a signal cut it off,
+ *  or, when the module was loaded with deterministic=1, after one record's worth of bytes. */
+#define TDLCHAR_IOC_TRANSFORM      _IOW(TDLCHAR_IOC_MAGIC, 6, struct tdlchar_xform)
+
+/** Transform a vector of buffers in one call, in order.  Returns the total number of bytes
+ *  transformed, which is short, like writev(), if a fault or signal stopped it part way, or for
+ *  the same reason as with TDLCHAR_IOC_TRANSFORM. */
+#define TDLCHAR_IOC_TRANSFORMV     _IOW(TDLCHAR_IOC_MAGIC, 7, struct tdlchar_xformv)
+
+/** Get the number of bytes the next read() returns, given a large enough buffer, or 0 if it would
+ *  block.  Nothing is read.  FIONREAD gets the unread bytes of all partitions the reader owns.
+ *  Neither joins a consumer group: before the fd has joined one, this returns 0 and FIONREAD the
+ *  bytes queued in the whole device. */
+#define TDLCHAR_IOC_PEEK_SIZE      _IOR(TDLCHAR_IOC_MAGIC, 8, __u64)
+
+/** Copy up to len bytes of the record the next read() returns to buf without consuming it.  Fills
+ *  in seq and size and returns the number of bytes copied.  Blocks, like read(), until there is a
+ *  record unless the device was opened with O_NONBLOCK. */
+#define TDLCHAR_IOC_PEEK           _IOWR(TDLCHAR_IOC_MAGIC, 9, struct tdlchar_peek)
+
+#endif /* TDLCHAR_IOCTL_H */
@@ -0,0 +1,57 @@
+/**
+ * @file   tdlchar_trace.h
+ * @author Todd Leonhardt
+ * @date   18 Oct 2026
+ * @version 1.0
+ * @brief  Tracepoints of the tdlchar LKM.  Like every trace header this is included twice by
+ * tdlchar.c, the second time with CREATE_TRACE_POINTS defined to generate the event code.  The
+ * events appear under /sys/kernel/tracing/events/tdlchar/.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tdlchar
+
+#if !defined(_TDLCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TDLCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/** A read or write took longer than its slow_read_us or slow_write_us threshold.  The total is
+ *  broken down into time spent waiting (for locks, records or queue space), copying to or from
+ *  user space, and working on the queue.  The pid and command are in the common trace fields. */
+TRACE_EVENT(tdlchar_slow_op,
+
+   TP_PROTO(int op, size_t size, u64 total_ns, u64 wait_ns, u64 copy_ns, u64 queue_ns),
+
+   TP_ARGS(op, size, total_ns, wait_ns, copy_ns, queue_ns),
+
+   TP_STRUCT__entry(
+      __field(int,    op)
+      __field(size_t, size)
+      __field(u64,    total_ns)
+      __field(u64,    wait_ns)
+      __field(u64,    copy_ns)
+      __field(u64,    queue_ns)
+   ),
+
+   TP_fast_assign(
+      __entry->op       = op;
+      __entry->size     = size;
+      __entry->total_ns = total_ns;
+      __entry->wait_ns  = wait_ns;
+      __entry->copy_ns  = copy_ns;
+      __entry->queue_ns = queue_ns;
+   ),
+
+   TP_printk("op=%s size=%zu total_ns=%llu wait_ns=%llu copy_ns=%llu queue_ns=%llu",
+             __print_symbolic(__entry->op, { 0, "read" }, { 1, "write" }),
+             __entry->size, __entry->total_ns, __entry->wait_ns, __entry->copy_ns,
+             __entry->queue_ns)
+);
+
+#endif /* _TDLCHAR_TRACE_H */
+
+// This part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE tdlchar_trace
+#include <trace/define_trace.h>
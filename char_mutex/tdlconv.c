@@ -0,0 +1,691 @@
+/**
+ * @file   tdlconv.c
+ * @author Todd Leonhardt
+ * @date   18 Oct 2026
+ * @version 1.0
+ * @brief  A bulk file converter that runs many files through /dev/tdlchar concurrently using
+ * io_uring.  Each input file is converted to upper case and written next to it with a suffix
+ * (".upper" by default) or into an output directory:
+ *
+ *    ./tdlconv -j 32 -o /data/out /data/in/2026-10-*.log
+ *    find /data/in -name '*.log' | ./tdlconv -l -
+ *
+ * Every file is split into chunks that each own one registered buffer.  A chunk moves through
+ * three stages: a READ_FIXED from the input file, a conversion in place with TDLCHAR_IOC_TRANSFORMV
+ * and a WRITE_FIXED to the output file.  Disk reads and writes for many files are kept in flight
+ * at once.  The conversion queues nothing on the device, so other readers and writers of it never
+ * see the converter's data and it never sees theirs; every chunk that finished reading since the
+ * last round trip to the kernel is converted with one ioctl.  The input and output files are
+ * registered with the ring as fixed files.
+ *
+ * The raw io_uring system calls are used directly so there is no dependency on liburing.
+ *
+ * Usage: tdlconv [-j files] [-n buffers] [-c chunk_size] [-s suffix] [-o dir] [-d device]
+ *                [-l list] [files...]
+ */
+#include<stdio.h>
+#include<stdlib.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<string.h>
+#include<unistd.h>
+#include<libgen.h>
+#include<time.h>
+#include<stdint.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/syscall.h>
+#include<sys/uio.h>
+#include<sys/ioctl.h>
+#include<linux/io_uring.h>
+#include "tdlchar_ioctl.h"
+
+#define DEVICE_PATH     "/dev/tdlchar"  ///< The device node created by the LKM
+#define RING_ENTRIES    1024            ///< Submission queue size
+#define DEFAULT_JOBS    16              ///< Files open at once
+#define DEFAULT_BUFFERS 64              ///< Registered buffers (chunks in flight)
+#define DEFAULT_CHUNK   (64 * 1024)     ///< Bytes per chunk
+
+// Each SQE's user_data holds the stage in the low bit and the chunk index above that
+enum stage { ST_READ = 0, ST_WRITE };
+#define UDATA(chunk, stage)         (((unsigned long long)(chunk) << 1) | (stage))
+
+/** @brief The memory-mapped submission and completion rings */
+struct ring
+{
+   int                  fd;
+   unsigned            *sq_head, *sq_tail, *sq_mask, *sq_array;
+   unsigned             sq_entries;
+   struct io_uring_sqe *sqes;
+   unsigned            *cq_head, *cq_tail, *cq_mask;
+   struct io_uring_cqe *cqes;
+   unsigned             sq_local_tail;  ///< Tail including SQEs not yet published to the kernel
+   unsigned             to_submit;      ///< SQEs queued since the last io_uring_enter()
+};
+
+/** @brief An input/output file pair being converted */
+struct job
+{
+   const char *path;
+   int         in_fd, out_fd;           ///< Regular descriptors, kept to close when done
+   int         in_slot, out_slot;       ///< Fixed file indexes
+   off_t       size;                    ///< Size of the input
+   off_t       next_off;                ///< Offset of the next chunk to read
+   int         inflight;                ///< Chunks of this file not yet written
+   int         active;
+};
+
+/** @brief A registered buffer and the piece of a file it currently holds */
+struct chunk
+{
+   struct job *job;
+   off_t       off;                     ///< Offset in the input and output file
+   size_t      len;                     ///< Valid bytes in the buffer
+   size_t      got;                     ///< Bytes read from the input so far
+   size_t      converted;               ///< Bytes converted by the device so far
+   size_t      written;                 ///< Bytes written to the output so far
+   int         next;                    ///< Free list or device queue link
+};
+
+static struct ring   ring;
+static struct job   *jobs;
+static struct chunk *chunks;
+static char         *buffers;
+static int           njobs = DEFAULT_JOBS, nbufs = DEFAULT_BUFFERS;
+static size_t        chunk_size = DEFAULT_CHUNK;
+static const char   *suffix = ".upper", *outdir = NULL, *device = DEVICE_PATH;
+
+static int free_head = -1;                       ///< Free chunk list
+static int devq_head = -1, devq_tail = -1;       ///< Chunks waiting for the device
+static struct tdlchar_xform *xf;                 ///< Vector for TDLCHAR_IOC_TRANSFORMV
+static unsigned long long bytes_done = 0;
+static int files_done = 0, files_failed = 0;
+
+// Input file names come from the command line or, with -l, one per line from a list file
+static char **argv_files;
+static int    argv_count, argv_next;
+static FILE  *list;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+   return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+   return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+   return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/** @brief Create the ring and map its queues
+ *  @return 0 on success, -1 on error
+ */
+static int ring_init(struct ring *r, unsigned entries)
+{
+   struct io_uring_params p;
+   size_t sq_len, cq_len;
+   char *sq, *cq;
+
+   memset(&p, 0, sizeof(p));
+   r->fd = io_uring_setup(entries, &p);
+   if (r->fd < 0)
+      return -1;
+
+   sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   if (p.features & IORING_FEAT_SINGLE_MMAP)
+      sq_len = cq_len = (sq_len > cq_len) ? sq_len : cq_len;
+
+   sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+             IORING_OFF_SQ_RING);
+   if (sq == MAP_FAILED)
+      return -1;
+   if (p.features & IORING_FEAT_SINGLE_MMAP)
+      cq = sq;
+   else
+   {
+      cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                IORING_OFF_CQ_RING);
+      if (cq == MAP_FAILED)
+         return -1;
+   }
+   r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+   if (r->sqes == MAP_FAILED)
+      return -1;
+
+   r->sq_head    = (unsigned *)(sq + p.sq_off.head);
+   r->sq_tail    = (unsigned *)(sq + p.sq_off.tail);
+   r->sq_mask    = (unsigned *)(sq + p.sq_off.ring_mask);
+   r->sq_array   = (unsigned *)(sq + p.sq_off.array);
+   r->sq_entries = p.sq_entries;
+   r->cq_head    = (unsigned *)(cq + p.cq_off.head);
+   r->cq_tail    = (unsigned *)(cq + p.cq_off.tail);
+   r->cq_mask    = (unsigned *)(cq + p.cq_off.ring_mask);
+   r->cqes       = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+   r->sq_local_tail = *r->sq_tail;
+   r->to_submit  = 0;
+   return 0;
+}
+
+/** @brief Publish queued SQEs and optionally wait for completions
+ *  @return 0 on success, -1 on error
+ */
+static int ring_submit(struct ring *r, unsigned wait_nr)
+{
+   int ret;
+
+   __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+   do
+   {
+      ret = io_uring_enter(r->fd, r->to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+   } while (ret < 0 && errno == EINTR);
+   if (ret < 0)
+      return -1;
+   r->to_submit = 0;
+   return 0;
+}
+
+/** @brief Get the next free SQE, flushing the queue to the kernel if it is full */
+static struct io_uring_sqe *ring_get_sqe(struct ring *r)
+{
+   struct io_uring_sqe *sqe;
+   unsigned idx;
+
+   while (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+   {
+      if (ring_submit(r, 0) < 0)
+         return NULL;
+   }
+   idx = r->sq_local_tail & *r->sq_mask;
+   sqe = &r->sqes[idx];
+   memset(sqe, 0, sizeof(*sqe));
+   r->sq_array[idx] = idx;
+   r->sq_local_tail++;
+   r->to_submit++;
+   return sqe;
+}
+
+/** @brief Fill in a fixed-file, fixed-buffer read or write */
+static void prep_rw(struct io_uring_sqe *sqe, int op, int slot, void *addr, size_t len, off_t off,
+                    int buf_index, unsigned long long udata)
+{
+   sqe->opcode    = op;
+   sqe->flags     = IOSQE_FIXED_FILE;
+   sqe->fd        = slot;
+   sqe->addr      = (unsigned long)addr;
+   sqe->len       = len;
+   sqe->off       = off;
+   sqe->buf_index = buf_index;
+   sqe->user_data = udata;
+}
+
+/** @brief Point a fixed file slot at a descriptor (-1 clears it) */
+static int update_slot(int slot, int fd)
+{
+   struct io_uring_files_update up;
+
+   memset(&up, 0, sizeof(up));
+   up.offset = slot;
+   up.fds = (unsigned long)&fd;
+   return io_uring_register(ring.fd, IORING_REGISTER_FILES_UPDATE, &up, 1) == 1 ? 0 : -1;
+}
+
+static char *chunk_buf(int c)
+{
+   return buffers + (size_t)c * chunk_size;
+}
+
+/** @brief Queue the rest of a chunk's input read */
+static int submit_rest(int c)
+{
+   struct chunk *ch = &chunks[c];
+   struct io_uring_sqe *sqe = ring_get_sqe(&ring);
+
+   if (!sqe)
+      return -1;
+   prep_rw(sqe, IORING_OP_READ_FIXED, ch->job->in_slot, chunk_buf(c) + ch->got,
+           ch->len - ch->got, ch->off + ch->got, c, UDATA(c, ST_READ));
+   return 0;
+}
+
+/** @brief Claim the next chunk of a job's input file and queue its read */
+static int submit_read(struct job *j, int c)
+{
+   struct chunk *ch = &chunks[c];
+   off_t left = j->size - j->next_off;
+
+   ch->job = j;
+   ch->off = j->next_off;
+   ch->len = (left < (off_t)chunk_size) ? (size_t)left : chunk_size;
+   ch->got = 0;
+   ch->converted = 0;
+   ch->written = 0;
+   j->next_off += ch->len;
+   j->inflight++;
+   return submit_rest(c);
+}
+
+/** @brief Queue the rest of a chunk's output write */
+static int submit_write(int c)
+{
+   struct chunk *ch = &chunks[c];
+   struct io_uring_sqe *sqe = ring_get_sqe(&ring);
+
+   if (!sqe)
+      return -1;
+   prep_rw(sqe, IORING_OP_WRITE_FIXED, ch->job->out_slot, chunk_buf(c) + ch->written,
+           ch->len - ch->written, ch->off + ch->written, c, UDATA(c, ST_WRITE));
+   return 0;
+}
+
+static void device_enqueue(int c)
+{
+   chunks[c].next = -1;
+   if (devq_tail < 0)
+      devq_head = c;
+   else
+      chunks[devq_tail].next = c;
+   devq_tail = c;
+}
+
+static void chunk_release(int c)
+{
+   chunks[c].job = NULL;
+   chunks[c].next = free_head;
+   free_head = c;
+}
+
+/** @brief Close a job's files once every chunk has been written */
+static void job_finish(struct job *j, int failed)
+{
+   update_slot(j->in_slot, -1);
+   update_slot(j->out_slot, -1);
+   close(j->in_fd);
+   if (close(j->out_fd) < 0)
+      failed = 1;
+   if (failed)
+   {
+      fprintf(stderr, "tdlconv: failed to convert %s\n", j->path);
+      files_failed++;
+   }
+   else
+      files_done++;
+   j->active = 0;
+   if (list)
+      free((char *)j->path);
+}
+
+/** @brief Build the output path for an input file: the same name in the output directory if one
+ *  was given, otherwise the input path with the suffix appended
+ */
+static void output_path(const char *in, char *out, size_t len)
+{
+   if (outdir)
+   {
+      char *copy = strdup(in);
+      snprintf(out, len, "%s/%s", outdir, copy ? basename(copy) : in);
+      free(copy);
+   }
+   else
+      snprintf(out, len, "%s%s", in, suffix);
+}
+
+/** @brief Open the next input file into a free job slot
+ *  @return 1 if a job was started, 0 if there are no more files
+ */
+static int job_start(struct job *j, int idx, const char *path)
+{
+   char out[4096];
+   struct stat st;
+
+   memset(j, 0, sizeof(*j));
+   j->path = path;
+   j->in_slot = 2 * idx;
+   j->out_slot = 2 * idx + 1;
+   j->in_fd = open(path, O_RDONLY);
+   if (j->in_fd < 0 || fstat(j->in_fd, &st) < 0)
+   {
+      perror(path);
+      if (j->in_fd >= 0)
+         close(j->in_fd);
+      files_failed++;
+      if (list)
+         free((char *)path);
+      return 0;
+   }
+   output_path(path, out, sizeof(out));
+   j->out_fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (j->out_fd < 0)
+   {
+      perror(out);
+      close(j->in_fd);
+      files_failed++;
+      if (list)
+         free((char *)path);
+      return 0;
+   }
+   if (update_slot(j->in_slot, j->in_fd) < 0 || update_slot(j->out_slot, j->out_fd) < 0)
+   {
+      perror("tdlconv: failed to register files");
+      close(j->in_fd);
+      close(j->out_fd);
+      files_failed++;
+      if (list)
+         free((char *)path);
+      return 0;
+   }
+   j->size = st.st_size;
+   j->active = 1;
+   if (j->size == 0)
+      job_finish(j, 0);
+   return 1;
+}
+
+static const char *next_path(void)
+{
+   static char line[4096];
+
+   if (list)
+   {
+      while (fgets(line, sizeof(line), list))
+      {
+         size_t n = strcspn(line, "\n");
+         line[n] = '\0';
+         if (n > 0)
+            return strdup(line);
+      }
+      return NULL;
+   }
+   return argv_next < argv_count ? argv_files[argv_next++] : NULL;
+}
+
+/** @brief Keep reads in flight: open files into idle job slots and hand out free buffers */
+static int fill(int *more)
+{
+   int i;
+
+   for (i = 0; i < njobs && *more; i++)
+   {
+      while (!jobs[i].active && *more)
+      {
+         const char *path = next_path();
+         if (!path)
+            *more = 0;
+         else
+            job_start(&jobs[i], i, path);
+      }
+   }
+
+   // Round-robin the free buffers over the open files so they all make progress
+   for (;;)
+   {
+      int started = 0;
+      for (i = 0; i < njobs && free_head >= 0; i++)
+      {
+         struct job *j = &jobs[i];
+         if (j->active && j->next_off < j->size)
+         {
+            int c = free_head;
+            free_head = chunks[c].next;
+            if (submit_read(j, c) < 0)
+               return -1;
+            started = 1;
+         }
+      }
+      if (!started || free_head < 0)
+         break;
+   }
+   return 0;
+}
+
+/** @brief Drop a chunk after an error, finishing its job once nothing else is in flight */
+static void chunk_fail(int c)
+{
+   struct job *j = chunks[c].job;
+
+   j->next_off = j->size;          // stop reading more of this file
+   j->size = -1;                   // remember that it failed
+   chunk_release(c);
+   if (--j->inflight == 0)
+      job_finish(j, 1);
+}
+
+/** @brief Convert the chunks waiting for the device in place with one TDLCHAR_IOC_TRANSFORMV and
+ *  queue their output writes.  A short count (a signal or a fault) leaves the rest of the vector
+ *  for the next call.
+ *  @return 0 on success, -1 on error
+ */
+static int convert(int dev)
+{
+   struct tdlchar_xformv v;
+   unsigned count = 0;
+   ssize_t done;
+   int c;
+
+   for (c = devq_head; c >= 0 && count < TDLCHAR_XFORM_MAX; c = chunks[c].next, count++)
+   {
+      xf[count].in = xf[count].out = (uintptr_t)(chunk_buf(c) + chunks[c].converted);
+      xf[count].len = chunks[c].len - chunks[c].converted;
+   }
+   if (count == 0)
+      return 0;
+   memset(&v, 0, sizeof(v));
+   v.vec = (uintptr_t)xf;
+   v.count = count;
+   done = ioctl(dev, TDLCHAR_IOC_TRANSFORMV, &v);
+   if (done < 0)
+      return errno == EINTR ? 0 : -1;
+   if (done == 0)
+   {
+      errno = EIO;
+      return -1;
+   }
+
+   while (devq_head >= 0)
+   {
+      struct chunk *ch = &chunks[devq_head];
+      size_t left = ch->len - ch->converted;
+
+      if ((size_t)done < left)
+      {
+         ch->converted += done;
+         break;
+      }
+      done -= left;
+      ch->converted = ch->len;
+      c = devq_head;
+      devq_head = ch->next;
+      if (devq_head < 0)
+         devq_tail = -1;
+      if (submit_write(c) < 0)
+         return -1;
+   }
+   return 0;
+}
+
+/** @brief Handle one completion */
+static int complete(struct io_uring_cqe *cqe)
+{
+   int c = cqe->user_data >> 1;
+   int stage = cqe->user_data & 1;
+   struct chunk *ch = &chunks[c];
+   struct job *j = ch->job;
+
+   switch (stage)
+   {
+   case ST_READ:
+      if (cqe->res <= 0)
+      {
+         // The size was taken with fstat(), so end of file this early means it shrank
+         fprintf(stderr, "tdlconv: read %s: %s\n", j->path,
+                 cqe->res < 0 ? strerror(-cqe->res) : "unexpected end of file");
+         chunk_fail(c);
+         break;
+      }
+      // Later chunks of the file are already being read, so a short read is finished here
+      ch->got += cqe->res;
+      if (ch->got < ch->len)
+         return submit_rest(c);
+      device_enqueue(c);
+      break;
+
+   case ST_WRITE:
+      if (cqe->res <= 0)
+      {
+         // A write that makes no progress would be retried forever
+         fprintf(stderr, "tdlconv: write %s: %s\n", j->path,
+                 cqe->res < 0 ? strerror(-cqe->res) : "no progress");
+         chunk_fail(c);
+         break;
+      }
+      ch->written += cqe->res;
+      if (ch->written < ch->len)
+         return submit_write(c);
+      bytes_done += ch->len;
+      chunk_release(c);
+      if (--j->inflight == 0 && j->next_off >= j->size)
+         job_finish(j, j->size < 0);
+      break;
+   }
+   return 0;
+}
+
+int main(int argc, char *argv[])
+{
+   struct timespec start, end;
+   struct iovec *iov;
+   int *fds, dev, opt, i, more = 1;
+   double secs;
+
+   while ((opt = getopt(argc, argv, "j:n:c:s:o:l:d:")) != -1)
+   {
+      switch (opt)
+      {
+      case 'j': njobs = atoi(optarg); break;
+      case 'n': nbufs = atoi(optarg); break;
+      case 'c': chunk_size = strtoul(optarg, NULL, 0); break;
+      case 's': suffix = optarg; break;
+      case 'o': outdir = optarg; break;
+      case 'd': device = optarg; break;
+      case 'l':
+         list = strcmp(optarg, "-") ? fopen(optarg, "r") : stdin;
+         if (!list)
+         {
+            perror(optarg);
+            return errno;
+         }
+         break;
+      default:
+         fprintf(stderr, "Usage: %s [-j files] [-n buffers] [-c chunk_size] [-s suffix] "
+                         "[-o dir] [-d device] [-l list] [files...]\n", argv[0]);
+         return EINVAL;
+      }
+   }
+   argv_files = argv + optind;
+   argv_count = argc - optind;
+
+   // Each chunk has at most one SQE in flight
+   if (njobs <= 0 || nbufs <= 0 || chunk_size == 0 || nbufs > RING_ENTRIES)
+   {
+      fprintf(stderr, "tdlconv: need jobs > 0, 0 < buffers <= %d and chunk_size > 0\n",
+              RING_ENTRIES);
+      return EINVAL;
+   }
+
+   dev = open(device, O_RDWR);
+   if (dev < 0)
+   {
+      perror("tdlconv: failed to open the device");
+      return errno;
+   }
+   if (ring_init(&ring, RING_ENTRIES) < 0)
+   {
+      perror("tdlconv: io_uring setup failed");
+      return errno;
+   }
+
+   // Register the buffers and a sparse file table with an in/out pair per job
+   if (posix_memalign((void **)&buffers, sysconf(_SC_PAGESIZE), (size_t)nbufs * chunk_size) != 0)
+   {
+      fprintf(stderr, "tdlconv: out of memory\n");
+      return ENOMEM;
+   }
+   jobs   = calloc(njobs, sizeof(*jobs));
+   chunks = calloc(nbufs, sizeof(*chunks));
+   iov    = calloc(nbufs, sizeof(*iov));
+   fds    = malloc(2 * njobs * sizeof(*fds));
+   xf     = calloc(nbufs < TDLCHAR_XFORM_MAX ? nbufs : TDLCHAR_XFORM_MAX, sizeof(*xf));
+   if (!jobs || !chunks || !iov || !fds || !xf)
+   {
+      fprintf(stderr, "tdlconv: out of memory\n");
+      return ENOMEM;
+   }
+   for (i = 0; i < nbufs; i++)
+   {
+      iov[i].iov_base = chunk_buf(i);
+      iov[i].iov_len = chunk_size;
+      chunk_release(i);
+   }
+   if (io_uring_register(ring.fd, IORING_REGISTER_BUFFERS, iov, nbufs) < 0)
+   {
+      perror("tdlconv: failed to register buffers");
+      return errno;
+   }
+   for (i = 0; i < 2 * njobs; i++)
+      fds[i] = -1;
+   if (io_uring_register(ring.fd, IORING_REGISTER_FILES, fds, 2 * njobs) < 0)
+   {
+      perror("tdlconv: failed to register files");
+      return errno;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (;;)
+   {
+      unsigned head, tail, inflight = 0;
+
+      if (fill(&more) < 0 || convert(dev) < 0)
+      {
+         perror("tdlconv: submission failed");
+         return errno;
+      }
+      for (i = 0; i < njobs; i++)
+         inflight += jobs[i].active;
+      if (!inflight && !more)
+         break;
+
+      // Don't wait for a completion while chunks are left to convert after a short ioctl
+      if (ring_submit(&ring, devq_head < 0) < 0)
+      {
+         perror("tdlconv: io_uring_enter");
+         return errno;
+      }
+
+      head = *ring.cq_head;
+      tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != tail; head++)
+      {
+         if (complete(&ring.cqes[head & *ring.cq_mask]) < 0)
+         {
+            perror("tdlconv: submission failed");
+            return errno;
+         }
+      }
+      __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+   printf("%d files converted, %d failed, %llu bytes in %.3f s (%.3f GB/s)\n",
+          files_done, files_failed, bytes_done, secs,
+          secs > 0 ? bytes_done / secs / 1e9 : 0.0);
+
+   close(ring.fd);
+   close(dev);
+   return files_failed ? EIO : 0;
+}
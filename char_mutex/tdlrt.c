@@ -0,0 +1,224 @@
+/**
+ * @file   tdlrt.c
+ * @author Todd Leonhardt
+ * @date   18 Oct 2026
+ * @version 1.0
+ * @brief  A cyclictest-style latency benchmark for /dev/tdlchar, for checking the module's
+ * deterministic mode on PREEMPT_RT kernels.  A SCHED_FIFO thread with its memory locked wakes up
+ * on an absolute period and, each cycle, writes a record to the device and reads it back.  At the
+ * end it prints the minimum, average, percentiles and maximum of the wakeup latency (how late the
+ * thread woke up) and of the write and read calls.  The maximum is what counts on a real-time
+ * system; run it for long enough, with the usual load on the machine, to see the outliers.
+ *
+ *    sudo insmod tdlchar.ko deterministic=1 pool_buffers=64
+ *    sudo ./tdlrt -l 1000000
+ *
+ * The benchmark joins its own consumer group, which starts after the last record already queued,
+ * so other readers of the device are not disturbed and don't take its records.  It should be the
+ * only writer while it runs, though: it reads back whatever record comes next.
+ *
+ * Usage: tdlrt [-d device] [-i interval_us] [-l loops] [-p priority] [-s size]
+ */
+#include<stdio.h>
+#include<stdlib.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<string.h>
+#include<unistd.h>
+#include<signal.h>
+#include<stdint.h>
+#include<time.h>
+#include<sched.h>
+#include<sys/mman.h>
+#include<sys/ioctl.h>
+#include "tdlchar_ioctl.h"
+
+#define DEVICE_PATH    "/dev/tdlchar"   ///< The device node created by the LKM
+#define HIST_US        10000            ///< Latencies are counted per microsecond up to this
+#define NSEC_PER_SEC   1000000000LL
+
+/** @brief The latencies of one kind of event, like cyclictest's per-thread statistics */
+struct lat
+{
+   const char *name;
+   uint64_t    count;
+   uint64_t    sum_ns;
+   uint64_t    min_ns;
+   uint64_t    max_ns;
+   uint64_t    hist[HIST_US + 1];       ///< [i] counts [i, i+1) us, the last everything longer
+};
+
+static struct lat wakeup = { .name = "wakeup", .min_ns = UINT64_MAX };
+static struct lat writes = { .name = "write",  .min_ns = UINT64_MAX };
+static struct lat reads  = { .name = "read",   .min_ns = UINT64_MAX };
+static volatile sig_atomic_t stop = 0;   ///< Set by SIGINT and SIGTERM
+
+static void on_signal(int sig)
+{
+   (void)sig;
+   stop = 1;
+}
+
+static int64_t ts_ns(const struct timespec *ts)
+{
+   return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static int64_t now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts_ns(&ts);
+}
+
+/** @brief Count one latency */
+static void lat_add(struct lat *lat, int64_t ns)
+{
+   uint64_t us;
+
+   if (ns < 0)
+      ns = 0;
+   us = ns / 1000;
+   lat->count++;
+   lat->sum_ns += ns;
+   if ((uint64_t)ns < lat->min_ns)
+      lat->min_ns = ns;
+   if ((uint64_t)ns > lat->max_ns)
+      lat->max_ns = ns;
+   lat->hist[us < HIST_US ? us : HIST_US]++;
+}
+
+/** @brief The latency in us below which the given fraction of the events fell */
+static double lat_percentile(const struct lat *lat, double fraction)
+{
+   uint64_t want = (uint64_t)(lat->count * fraction), seen = 0;
+   unsigned int i;
+
+   for (i = 0; i < HIST_US; i++)
+   {
+      seen += lat->hist[i];
+      if (seen > want)
+         return i + 1;
+   }
+   return lat->max_ns / 1000.0;          // among the ones too long for the histogram
+}
+
+static void lat_print(const struct lat *lat)
+{
+   if (lat->count == 0)
+   {
+      printf("%-7s %10s\n", lat->name, "-");
+      return;
+   }
+   printf("%-7s %10.1f %10.1f %10.0f %10.0f %10.0f %10.1f\n", lat->name, lat->min_ns / 1000.0,
+          (double)lat->sum_ns / lat->count / 1000.0, lat_percentile(lat, 0.99),
+          lat_percentile(lat, 0.9999), lat_percentile(lat, 0.999999), lat->max_ns / 1000.0);
+}
+
+static void usage(const char *prog)
+{
+   fprintf(stderr, "Usage: %s [-d device] [-i interval_us] [-l loops] [-p priority] [-s size]\n",
+           prog);
+   exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+   const char *device = DEVICE_PATH;
+   long interval_us = 1000, loops = 100000, size = 64;
+   int priority = 80, fd, opt;
+   struct sched_param param;
+   struct tdlchar_group group;
+   struct timespec next;
+   char *msg, *buf;
+   int64_t start;
+   ssize_t ret;
+   long i, errors = 0;
+
+   while ((opt = getopt(argc, argv, "d:i:l:p:s:")) != -1)
+   {
+      switch (opt)
+      {
+      case 'd': device = optarg; break;
+      case 'i': interval_us = strtol(optarg, NULL, 0); break;
+      case 'l': loops = strtol(optarg, NULL, 0); break;
+      case 'p': priority = atoi(optarg); break;
+      case 's': size = strtol(optarg, NULL, 0); break;
+      default: usage(argv[0]);
+      }
+   }
+   if (interval_us <= 0 || loops <= 0 || size <= 0)
+      usage(argv[0]);
+
+   msg = malloc(size);
+   buf = malloc(size);
+   if (!msg || !buf)
+   {
+      perror("malloc");
+      return EXIT_FAILURE;
+   }
+   for (i = 0; i < size; i++)
+      msg[i] = 'a' + i % 26;
+
+   fd = open(device, O_RDWR);
+   if (fd < 0)
+   {
+      perror("Failed to open the device");
+      return errno;
+   }
+   // A group of our own, joined before the loop: joining allocates in the kernel
+   memset(&group, 0, sizeof(group));
+   snprintf(group.name, sizeof(group.name), "tdlrt-%d", getpid());
+   if (ioctl(fd, TDLCHAR_IOC_JOIN_GROUP, &group) < 0)
+   {
+      perror("TDLCHAR_IOC_JOIN_GROUP");
+      return errno;
+   }
+
+   // No page faults and no other normal task in the way once the loop is running
+   if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+      perror("mlockall");
+   param.sched_priority = priority;
+   if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+      perror("sched_setscheduler, running at normal priority");
+   signal(SIGINT, on_signal);
+   signal(SIGTERM, on_signal);
+
+   clock_gettime(CLOCK_MONOTONIC, &next);
+   for (i = 0; i < loops && !stop; i++)
+   {
+      next.tv_nsec += interval_us * 1000;
+      while (next.tv_nsec >= NSEC_PER_SEC)
+      {
+         next.tv_nsec -= NSEC_PER_SEC;
+         next.tv_sec++;
+      }
+      if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0)
+         continue;                       // interrupted, stop is probably set
+      start = now_ns();
+      lat_add(&wakeup, start - ts_ns(&next));
+
+      ret = write(fd, msg, size);
+      lat_add(&writes, now_ns() - start);
+      if (ret != size)
+      {
+         errors++;
+         continue;
+      }
+      start = now_ns();
+      ret = read(fd, buf, size);
+      lat_add(&reads, now_ns() - start);
+      if (ret != size)
+         errors++;
+   }
+   close(fd);
+
+   printf("%ld cycles of %ld us, %ld bytes per record, %ld errors\n", i, interval_us, size,
+          errors);
+   printf("%-7s %10s %10s %10s %10s %10s %10s\n", "(us)", "min", "avg", "p99", "p99.99",
+          "p99.9999", "max");
+   lat_print(&wakeup);
+   lat_print(&writes);
+   lat_print(&reads);
+   return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
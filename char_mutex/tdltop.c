@@ -0,0 +1,537 @@
+/**
+ * @file   tdltop.c
+ * @author Todd Leonhardt
+ * @date   18 Oct 2026
+ * @version 1.0
+ * @brief  A top-like monitor for /dev/tdlchar.  Every interval it samples the device and shows,
+ * per partition and in total, records and MB per second in and out, queue depth, memory and
+ * spill use, and lock contention, with the read and write latency percentiles of the interval:
+ *
+ *    ./tdltop -i 0.5
+ *    ./tdltop -q -p /var/lib/node_exporter/textfile/tdlchar.prom
+ *
+ * With -p it also writes the counters in the Prometheus text format, for node_exporter's textfile
+ * collector, replacing the file atomically each interval.
+ *
+ * Sampling is meant to be safe during an incident.  The counters and latency histograms are read
+ * from the statistics pages mapped from the device, with plain loads: no system call and no lock
+ * in the module.  Memory use comes from two sysfs files and contention from debugfs (when it is
+ * readable, i.e. as root), which only read the module's atomic counters.
+ *
+ * Usage: tdltop [-d device] [-i seconds] [-n samples] [-b] [-p file [-q]]
+ */
+#include<stdio.h>
+#include<stdlib.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<string.h>
+#include<unistd.h>
+#include<signal.h>
+#include<stdint.h>
+#include<stddef.h>
+#include<time.h>
+#include<sys/mman.h>
+#include "tdlchar_ioctl.h"
+
+#define DEVICE_PATH    "/dev/tdlchar"   ///< The device node created by the LKM
+#define SYSFS_MEMORY   "/sys/class/tdl/tdlchar/memory/"
+#define DEBUGFS_LOCKS  "/sys/kernel/debug/tdlchar/locks"
+#define MAX_LOCKS      (256 + 8)        ///< Partition locks and the few others
+#define LOCK_NAME      32
+
+/** @brief One line of the debugfs locks file */
+struct lock_row
+{
+   char               name[LOCK_NAME];
+   unsigned long long acquired, contended, wait_ns, wait_max, hold_ns, hold_max;
+};
+
+/** @brief Everything read from the device at one point in time */
+struct sample
+{
+   double                   when;       ///< CLOCK_MONOTONIC seconds
+   struct tdlchar_shm_part *part;       ///< Consistent copies of the partitions' entries
+   __u64                    write_ns[TDLCHAR_SHM_BUCKETS];
+   __u64                    read_ns[TDLCHAR_SHM_BUCKETS];
+   long long                mem_bytes;  ///< -1 if sysfs couldn't be read
+   long long                peak_bytes;
+   struct lock_row          locks[MAX_LOCKS];
+   int                      nlocks;     ///< 0 without access to debugfs
+};
+
+static const volatile struct tdlchar_shm *shm;   ///< The mapped statistics pages
+static unsigned int nparts;                      ///< Partitions in them
+static volatile sig_atomic_t stop = 0;           ///< Set by SIGINT and SIGTERM
+
+static void on_signal(int sig)
+{
+   (void)sig;
+   stop = 1;
+}
+
+static double now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** @brief Map the statistics pages of the device, all of them
+ *  @return 0 on success, -1 with errno set on failure
+ */
+static int map_shm(const char *device)
+{
+   long page = sysconf(_SC_PAGESIZE);
+   const struct tdlchar_shm *first;
+   size_t len;
+   int fd;
+
+   fd = open(device, O_RDONLY);
+   if (fd < 0)
+      return -1;
+   // The first page tells how large the mapping has to be
+   first = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+   if (first == MAP_FAILED)
+   {
+      close(fd);
+      return -1;
+   }
+   if (first->version != TDLCHAR_SHM_VERSION || first->buckets != TDLCHAR_SHM_BUCKETS)
+   {
+      fprintf(stderr, "tdltop: statistics pages version %u, expected %u\n", first->version,
+              TDLCHAR_SHM_VERSION);
+      munmap((void *)first, page);
+      close(fd);
+      errno = EPROTO;
+      return -1;
+   }
+   nparts = first->partitions;
+   len = (first->size + page - 1) / page * page;
+   if (len > (size_t)page)
+   {
+      munmap((void *)first, page);
+      first = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+      if (first == MAP_FAILED)
+      {
+         close(fd);
+         return -1;
+      }
+   }
+   close(fd);                                     // the mapping keeps the device open
+   shm = first;
+   return 0;
+}
+
+/** @brief Copy one partition's entry, retrying while the module is updating it */
+static void read_part(unsigned int i, struct tdlchar_shm_part *snap)
+{
+   const volatile struct tdlchar_shm_part *p = &shm->part[i];
+   __u32 seq;
+
+   do
+   {
+      while ((seq = p->seq) & 1)
+         ;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      memcpy(snap, (const void *)p, sizeof(*snap));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   } while (p->seq != seq);
+}
+
+/** @brief Read a number from a sysfs file
+ *  @return the number, or -1 if the file can't be read
+ */
+static long long read_number(const char *path)
+{
+   long long val = -1;
+   FILE *f = fopen(path, "r");
+
+   if (!f)
+      return -1;
+   if (fscanf(f, "%lld", &val) != 1)
+      val = -1;
+   fclose(f);
+   return val;
+}
+
+/** @brief Read the lock totals from debugfs
+ *  @return the number of locks read, 0 if debugfs isn't readable
+ */
+static int read_locks(struct lock_row *rows)
+{
+   char line[256];
+   int n = 0;
+   FILE *f = fopen(DEBUGFS_LOCKS, "r");
+
+   if (!f)
+      return 0;
+   if (!fgets(line, sizeof(line), f))            // the column headings
+   {
+      fclose(f);
+      return 0;
+   }
+   while (n < MAX_LOCKS && fgets(line, sizeof(line), f))
+   {
+      struct lock_row *r = &rows[n];
+      if (sscanf(line, "%31s %llu %llu %llu %llu %llu %llu", r->name, &r->acquired,
+                 &r->contended, &r->wait_ns, &r->wait_max, &r->hold_ns, &r->hold_max) == 7)
+         n++;
+   }
+   fclose(f);
+   return n;
+}
+
+/** @brief Take a sample of every counter */
+static void take_sample(struct sample *s)
+{
+   unsigned int i;
+
+   s->when = now();
+   for (i = 0; i < nparts; i++)
+      read_part(i, &s->part[i]);
+   // Each bucket is updated atomically on its own; no need for them to agree with each other
+   for (i = 0; i < TDLCHAR_SHM_BUCKETS; i++)
+   {
+      s->write_ns[i] = shm->write_ns[i];
+      s->read_ns[i] = shm->read_ns[i];
+   }
+   s->mem_bytes = read_number(SYSFS_MEMORY "bytes");
+   s->peak_bytes = read_number(SYSFS_MEMORY "peak_bytes");
+   s->nlocks = read_locks(s->locks);
+}
+
+/** @brief Find a lock's row in a sample, by name */
+static const struct lock_row *find_lock(const struct sample *s, const char *name)
+{
+   int i;
+
+   for (i = 0; i < s->nlocks; i++)
+   {
+      if (strcmp(s->locks[i].name, name) == 0)
+         return &s->locks[i];
+   }
+   return NULL;
+}
+
+/** @brief Estimate a latency percentile of the operations between two samples
+ *  The histograms have log2 buckets, so this is the upper bound of the bucket the percentile
+ *  falls in: the true value is at most this, and more than half of it.
+ *  @return the latency in us, or -1 if there were no operations
+ */
+static double percentile(const __u64 *prev, const __u64 *cur, double fraction)
+{
+   __u64 delta[TDLCHAR_SHM_BUCKETS], total = 0, seen = 0;
+   int i;
+
+   for (i = 0; i < TDLCHAR_SHM_BUCKETS; i++)
+   {
+      delta[i] = cur[i] - prev[i];
+      total += delta[i];
+   }
+   if (total == 0)
+      return -1;
+   for (i = 0; i < TDLCHAR_SHM_BUCKETS - 1; i++)
+   {
+      seen += delta[i];
+      if (seen >= total * fraction)
+         break;
+   }
+   return (double)(2ULL << i) / 1000.0;          // bucket i is [2^i, 2^(i+1)) ns
+}
+
+/** @brief Print the latency percentiles of one operation */
+static void print_latency(const char *what, const __u64 *prev, const __u64 *cur)
+{
+   static const double fractions[] = { 0.5, 0.9, 0.99, 0.999 };
+   unsigned int i;
+
+   printf("%-5s latency (us, <=):", what);
+   for (i = 0; i < sizeof(fractions) / sizeof(fractions[0]); i++)
+   {
+      double us = percentile(prev, cur, fractions[i]);
+      if (us < 0)
+         printf("  p%-5g %9s", fractions[i] * 100, "-");
+      else
+         printf("  p%-5g %9.1f", fractions[i] * 100, us);
+   }
+   printf("\n");
+}
+
+/** @brief Print one row of the partition table from the difference of two samples */
+static void print_row(const char *name, const struct tdlchar_shm_part *p,
+                      const struct tdlchar_shm_part *c, const struct lock_row *lp,
+                      const struct lock_row *lc, double secs)
+{
+   printf("%-9s %10.0f %10.0f %9.2f %9.2f %9llu %10.1f %10.1f", name,
+          (c->writes - p->writes) / secs, (c->reads - p->reads) / secs,
+          (c->bytes_in - p->bytes_in) / secs / 1e6, (c->bytes_out - p->bytes_out) / secs / 1e6,
+          (unsigned long long)c->depth, c->mem_bytes / 1024.0, c->spill_bytes / 1024.0);
+   if (lp && lc)
+   {
+      // Share of the interval that tasks spent waiting for the lock, summed over the tasks
+      printf(" %10.0f %8.1f%%", (lc->contended - lp->contended) / secs,
+             (lc->wait_ns - lp->wait_ns) / secs / 1e7);
+   }
+   printf("\n");
+}
+
+/** @brief Print the screen for the interval between two samples */
+static void print_screen(const struct sample *prev, const struct sample *cur, int clear)
+{
+   struct tdlchar_shm_part tp = { 0 }, tc = { 0 };
+   struct lock_row lp, lc;
+   double secs = cur->when - prev->when;
+   const struct lock_row *a, *b;
+   char name[LOCK_NAME];
+   unsigned int i;
+   int locks = cur->nlocks > 0;
+
+   memset(&lp, 0, sizeof(lp));
+   memset(&lc, 0, sizeof(lc));
+   if (clear)
+      printf("\033[H\033[2J");
+   printf("tdltop - %u partitions, %.2f s interval", nparts, secs);
+   if (cur->mem_bytes >= 0)
+      printf(", record memory %.1f MiB (peak %.1f MiB)", cur->mem_bytes / 1048576.0,
+             cur->peak_bytes / 1048576.0);
+   printf("\n\n");
+   print_latency("write", prev->write_ns, cur->write_ns);
+   print_latency("read", prev->read_ns, cur->read_ns);
+   printf("\n%-9s %10s %10s %9s %9s %9s %10s %10s", "partition", "writes/s", "reads/s",
+          "MB/s in", "MB/s out", "depth", "mem KiB", "spill KiB");
+   if (locks)
+      printf(" %10s %9s", "contend/s", "wait");
+   printf("\n");
+
+   for (i = 0; i < nparts; i++)
+   {
+      const struct tdlchar_shm_part *p = &prev->part[i], *c = &cur->part[i];
+
+      snprintf(name, sizeof(name), "partition%u", i);
+      a = find_lock(prev, name);
+      b = find_lock(cur, name);
+      snprintf(name, sizeof(name), "%u", i);
+      print_row(name, p, c, a, b, secs);
+
+      tp.writes += p->writes;       tc.writes += c->writes;
+      tp.reads += p->reads;         tc.reads += c->reads;
+      tp.bytes_in += p->bytes_in;   tc.bytes_in += c->bytes_in;
+      tp.bytes_out += p->bytes_out; tc.bytes_out += c->bytes_out;
+      tc.depth += c->depth;
+      tc.mem_bytes += c->mem_bytes;
+      tc.spill_bytes += c->spill_bytes;
+      if (a && b)
+      {
+         lp.contended += a->contended; lc.contended += b->contended;
+         lp.wait_ns += a->wait_ns;     lc.wait_ns += b->wait_ns;
+      }
+   }
+   print_row("total", &tp, &tc, locks ? &lp : NULL, locks ? &lc : NULL, secs);
+
+   // The locks that aren't a partition's
+   if (locks)
+   {
+      printf("\n%-9s %10s %10s %10s %12s\n", "lock", "taken/s", "contend/s", "wait", "max wait us");
+      for (i = 0; i < (unsigned int)cur->nlocks; i++)
+      {
+         b = &cur->locks[i];
+         a = find_lock(prev, b->name);
+         if (!a || strncmp(b->name, "partition", 9) == 0)
+            continue;
+         printf("%-9s %10.0f %10.0f %9.1f%% %12.1f\n", b->name,
+                (b->acquired - a->acquired) / secs, (b->contended - a->contended) / secs,
+                (b->wait_ns - a->wait_ns) / secs / 1e7, b->wait_max / 1000.0);
+      }
+   }
+   fflush(stdout);
+}
+
+/** @brief Write one histogram in the Prometheus text format, in seconds
+ *  The module only keeps the buckets, so _sum is an estimate: each event counts as the middle of
+ *  its bucket, [2^i, 2^(i+1)) ns, and those in the last, open bucket as its lower bound.
+ */
+static void prom_histogram(FILE *f, const char *name, const char *help, const __u64 *hist)
+{
+   unsigned long long cum = 0;
+   double sum = 0;
+   int i;
+
+   fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+   for (i = 0; i < TDLCHAR_SHM_BUCKETS - 1; i++)
+   {
+      cum += hist[i];
+      sum += hist[i] * 1.5 * (double)(1ULL << i);
+      fprintf(f, "%s_bucket{le=\"%.9g\"} %llu\n", name, (double)(2ULL << i) / 1e9, cum);
+   }
+   cum += hist[TDLCHAR_SHM_BUCKETS - 1];
+   sum += hist[TDLCHAR_SHM_BUCKETS - 1] * (double)(1ULL << (TDLCHAR_SHM_BUCKETS - 1));
+   fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9g\n%s_count %llu\n", name, cum, name,
+           sum / 1e9, name, cum);
+}
+
+/** @brief Write one counter or gauge per partition */
+static void prom_parts(FILE *f, const struct sample *s, const char *name, const char *type,
+                       const char *help, size_t offset)
+{
+   unsigned int i;
+
+   fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+   for (i = 0; i < nparts; i++)
+      fprintf(f, "%s{partition=\"%u\"} %llu\n", name, i,
+              (unsigned long long)*(const __u64 *)((const char *)&s->part[i] + offset));
+}
+
+/** @brief Write one lock counter per lock */
+static void prom_locks(FILE *f, const struct sample *s, const char *name, const char *help,
+                       size_t offset, double scale)
+{
+   int i;
+
+   fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+   for (i = 0; i < s->nlocks; i++)
+      fprintf(f, "%s{lock=\"%s\"} %.9g\n", name, s->locks[i].name,
+              *(const unsigned long long *)((const char *)&s->locks[i] + offset) * scale);
+}
+
+/** @brief Write a sample for node_exporter's textfile collector.  The file is written under a
+ *  temporary name and renamed, so the collector never sees half of it.
+ *  @return 0 on success, -1 on failure
+ */
+static int write_prom(const char *path, const struct sample *s)
+{
+   char tmp[4096];
+   FILE *f;
+
+   snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+   f = fopen(tmp, "w");
+   if (!f)
+      return -1;
+
+   fprintf(f, "# HELP tdlchar_partitions Partitions the device was loaded with\n"
+              "# TYPE tdlchar_partitions gauge\ntdlchar_partitions %u\n", nparts);
+   prom_parts(f, s, "tdlchar_writes_total", "counter", "Records queued",
+              offsetof(struct tdlchar_shm_part, writes));
+   prom_parts(f, s, "tdlchar_reads_total", "counter", "Successful reads",
+              offsetof(struct tdlchar_shm_part, reads));
+   prom_parts(f, s, "tdlchar_written_bytes_total", "counter", "Bytes queued",
+              offsetof(struct tdlchar_shm_part, bytes_in));
+   prom_parts(f, s, "tdlchar_read_bytes_total", "counter", "Bytes read",
+              offsetof(struct tdlchar_shm_part, bytes_out));
+   prom_parts(f, s, "tdlchar_queue_depth", "gauge", "Records not yet read by every group",
+              offsetof(struct tdlchar_shm_part, depth));
+   prom_parts(f, s, "tdlchar_queued_memory_bytes", "gauge", "Bytes of queued records in memory",
+              offsetof(struct tdlchar_shm_part, mem_bytes));
+   prom_parts(f, s, "tdlchar_queued_spill_bytes", "gauge", "Bytes of queued records spilled",
+              offsetof(struct tdlchar_shm_part, spill_bytes));
+   prom_histogram(f, "tdlchar_write_duration_seconds", "Time taken by writes", s->write_ns);
+   prom_histogram(f, "tdlchar_read_duration_seconds", "Time taken by reads", s->read_ns);
+   if (s->mem_bytes >= 0)
+   {
+      fprintf(f, "# HELP tdlchar_memory_bytes Bytes allocated for records\n"
+                 "# TYPE tdlchar_memory_bytes gauge\ntdlchar_memory_bytes %lld\n", s->mem_bytes);
+      fprintf(f, "# HELP tdlchar_memory_peak_bytes High-water mark of tdlchar_memory_bytes\n"
+                 "# TYPE tdlchar_memory_peak_bytes gauge\ntdlchar_memory_peak_bytes %lld\n",
+              s->peak_bytes);
+   }
+   if (s->nlocks)
+   {
+      prom_locks(f, s, "tdlchar_lock_acquired_total", "Times the lock was taken",
+                 offsetof(struct lock_row, acquired), 1);
+      prom_locks(f, s, "tdlchar_lock_contended_total", "Times a task had to wait for the lock",
+                 offsetof(struct lock_row, contended), 1);
+      prom_locks(f, s, "tdlchar_lock_wait_seconds_total", "Time spent waiting for the lock",
+                 offsetof(struct lock_row, wait_ns), 1e-9);
+      prom_locks(f, s, "tdlchar_lock_hold_seconds_total", "Time the lock was held",
+                 offsetof(struct lock_row, hold_ns), 1e-9);
+   }
+
+   if (fclose(f) != 0 || rename(tmp, path) != 0)
+   {
+      unlink(tmp);
+      return -1;
+   }
+   return 0;
+}
+
+int main(int argc, char *argv[])
+{
+   const char *device = DEVICE_PATH, *prom = NULL;
+   struct sample samples[2], *prev = &samples[0], *cur = &samples[1], *tmp;
+   double interval = 1.0;
+   long count = 0, n;
+   int opt, batch = 0, quiet = 0, clear;
+   struct timespec ts;
+
+   while ((opt = getopt(argc, argv, "d:i:n:bp:q")) != -1)
+   {
+      switch (opt)
+      {
+      case 'd':
+         device = optarg;
+         break;
+      case 'i':
+         interval = strtod(optarg, NULL);
+         break;
+      case 'n':
+         count = strtol(optarg, NULL, 0);
+         break;
+      case 'b':
+         batch = 1;
+         break;
+      case 'p':
+         prom = optarg;
+         break;
+      case 'q':
+         quiet = 1;
+         break;
+      default:
+         fprintf(stderr, "Usage: %s [-d device] [-i seconds] [-n samples] [-b] [-p file [-q]]\n",
+                 argv[0]);
+         return EINVAL;
+      }
+   }
+   if (interval < 0.01 || count < 0 || (quiet && !prom))
+   {
+      fprintf(stderr, "tdltop: the interval must be at least 0.01 s, and -q needs -p\n");
+      return EINVAL;
+   }
+
+   if (map_shm(device) < 0)
+   {
+      perror("tdltop: failed to map the statistics pages");
+      return errno;
+   }
+   prev->part = calloc(nparts, sizeof(*prev->part));
+   cur->part = calloc(nparts, sizeof(*cur->part));
+   if (!prev->part || !cur->part)
+   {
+      perror("tdltop: failed to allocate samples");
+      return errno;
+   }
+   signal(SIGINT, on_signal);
+   signal(SIGTERM, on_signal);
+   clear = !batch && isatty(STDOUT_FILENO);
+   ts.tv_sec = (time_t)interval;
+   ts.tv_nsec = (long)((interval - ts.tv_sec) * 1e9);
+
+   take_sample(prev);
+   for (n = 0; !stop && (count == 0 || n < count); n++)
+   {
+      nanosleep(&ts, NULL);
+      if (stop)
+         break;
+      take_sample(cur);
+      if (!quiet)
+      {
+         print_screen(prev, cur, clear);
+         if (!clear)
+            printf("\n");
+      }
+      if (prom && write_prom(prom, cur) < 0)
+         perror("tdltop: failed to write the Prometheus file");
+      tmp = prev;
+      prev = cur;
+      cur = tmp;
+   }
+   return 0;
+}
@@ -0,0 +1,336 @@
+/**
+ * @file   tdltr.c
+ * @author Todd Leonhardt
+ * @date   18 Oct 2026
+ * @version 1.0
+ * @brief  A streaming filter that pushes stdin through /dev/tdlchar to stdout, so the device can be
+ * used in a shell pipeline the same way as `tr a-z A-Z`:
+ *
+ *    cat big.log | ./tdltr > upper.log
+ *
+ * stdin is read in large blocks.  Each block is converted in place with one TDLCHAR_IOC_TRANSFORM
+ * ioctl.  On a module too old for it, the block is fed to the device in pieces no bigger than the
+ * device accepts per write() (a short write tells us the size) and the converted bytes are read
+ * back in place, from a consumer group of our own.  That only keeps other readers from taking the
+ * converted bytes: the device must not have other writers meanwhile, since a new group sees every
+ * record written after it exists.  Output is double buffered: while one block is being written to
+ * stdout by a helper thread, the main thread reads and converts the next one.
+ *
+ * Usage: tdltr [-b block_size] [-d device]
+ */
+#include<stdio.h>
+#include<stdlib.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<string.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<stdint.h>
+#include<sys/ioctl.h>
+#include "tdlchar_ioctl.h"
+
+#define DEVICE_PATH    "/dev/tdlchar"   ///< The device node created by the LKM
+#define DEFAULT_BLOCK  (1 << 20)        ///< Default size of each stdin/stdout block (1 MiB)
+#define NUM_SLOTS      2                ///< Double buffering
+
+/** @brief One of the two blocks that flow between the converter and the stdout writer */
+struct slot
+{
+   char   *data;    ///< Block storage
+   size_t  len;     ///< Number of valid bytes, 0 marks end of stream
+   int     full;    ///< Set when the block is waiting to be written to stdout
+};
+
+static struct slot     slots[NUM_SLOTS];
+static pthread_mutex_t lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  cond  = PTHREAD_COND_INITIALIZER;
+static int             writer_error = 0;   ///< errno from the stdout writer, if it failed
+static int             use_ioctl = 1;      ///< Cleared if the device has no TDLCHAR_IOC_TRANSFORM
+
+/** @brief Read until len bytes have been read or end of file is hit
+ *  @return the number of bytes read, or -1 on error
+ */
+static ssize_t read_full(int fd, char *buf, size_t len)
+{
+   size_t done = 0;
+   while (done < len)
+   {
+      ssize_t ret = read(fd, buf + done, len - done);
+      if (ret < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return -1;
+      }
+      if (ret == 0)
+         break;
+      done += ret;
+   }
+   return done;
+}
+
+/** @brief Write all len bytes, retrying on short writes
+ *  @return 0 on success, -1 on error
+ */
+static int write_full(int fd, const char *buf, size_t len)
+{
+   while (len > 0)
+   {
+      ssize_t ret = write(fd, buf, len);
+      if (ret < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return -1;
+      }
+      buf += ret;
+      len -= ret;
+   }
+   return 0;
+}
+
+/** @brief Join a consumer group of our own, so the records we write are read back by us and not
+ *  by another reader in the default group.  Records other processes write still show up in it.
+ *  A module without groups has nothing to join.
+ *  @return 0 on success, -1 on error
+ */
+static int join_private_group(int dev)
+{
+   struct tdlchar_group group;
+
+   memset(&group, 0, sizeof(group));
+   snprintf(group.name, sizeof(group.name), "tdltr-%d", getpid());
+   if (ioctl(dev, TDLCHAR_IOC_JOIN_GROUP, &group) < 0 && errno != ENOTTY)
+      return -1;
+   return 0;
+}
+
+/** @brief Push a block through the device, replacing its contents with the converted bytes
+ *  @return 0 on success, -1 on error
+ */
+static int convert(int dev, char *buf, size_t len)
+{
+   struct tdlchar_xform xf;
+
+   // One call per block, and nothing is queued on the device
+   while (use_ioctl && len > 0)
+   {
+      ssize_t done;
+
+      xf.in = xf.out = (uintptr_t)buf;
+      xf.len = len;
+      done = ioctl(dev, TDLCHAR_IOC_TRANSFORM, &xf);
+      if (done < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         if (errno == ENOTTY)
+         {
+            use_ioctl = 0;         // an older module: fall back to write() and read()
+            if (join_private_group(dev) < 0)
+               return -1;
+            break;
+         }
+         return -1;
+      }
+      if (done == 0)
+      {
+         errno = EIO;
+         return -1;
+      }
+      buf += done;
+      len -= done;
+   }
+
+   while (len > 0)
+   {
+      ssize_t accepted, got, done = 0;
+
+      // The device takes as much as it can hold and reports it with a short write
+      accepted = write(dev, buf, len);
+      if (accepted < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return -1;
+      }
+      if (accepted == 0)
+      {
+         errno = EIO;
+         return -1;
+      }
+
+      // Read back exactly what was accepted, into the same place it came from
+      while (done < accepted)
+      {
+         got = read(dev, buf + done, accepted - done);
+         if (got < 0)
+         {
+            if (errno == EINTR)
+               continue;
+            return -1;
+         }
+         if (got == 0)
+         {
+            errno = EIO;           // the device lost our data
+            return -1;
+         }
+         done += got;
+      }
+      buf += accepted;
+      len -= accepted;
+   }
+   return 0;
+}
+
+/** @brief Helper thread that drains full slots to stdout in order */
+static void *writer_thread(void *arg)
+{
+   int i = 0;
+   (void)arg;
+
+   for (;;)
+   {
+      struct slot *s = &slots[i];
+      size_t len;
+
+      pthread_mutex_lock(&lock);
+      while (!s->full)
+         pthread_cond_wait(&cond, &lock);
+      len = s->len;
+      pthread_mutex_unlock(&lock);
+
+      if (len == 0)
+         break;                    // end of stream marker
+      if (!writer_error && write_full(STDOUT_FILENO, s->data, len) < 0)
+         writer_error = errno;
+
+      pthread_mutex_lock(&lock);
+      s->full = 0;
+      pthread_cond_broadcast(&cond);
+      pthread_mutex_unlock(&lock);
+      i = (i + 1) % NUM_SLOTS;
+   }
+   return NULL;
+}
+
+/** @brief Hand a slot to the writer thread */
+static void publish(struct slot *s, size_t len)
+{
+   pthread_mutex_lock(&lock);
+   s->len = len;
+   s->full = 1;
+   pthread_cond_broadcast(&cond);
+   pthread_mutex_unlock(&lock);
+}
+
+int main(int argc, char *argv[])
+{
+   const char *device = DEVICE_PATH;
+   size_t block = DEFAULT_BLOCK;
+   pthread_t writer;
+   int dev, opt, rc, i = 0, status = 0;
+
+   while ((opt = getopt(argc, argv, "b:d:")) != -1)
+   {
+      switch (opt)
+      {
+      case 'b':
+         block = strtoul(optarg, NULL, 0);
+         break;
+      case 'd':
+         device = optarg;
+         break;
+      default:
+         fprintf(stderr, "Usage: %s [-b block_size] [-d device]\n", argv[0]);
+         return EINVAL;
+      }
+   }
+   if (block == 0)
+   {
+      fprintf(stderr, "tdltr: block size must be greater than zero\n");
+      return EINVAL;
+   }
+
+   dev = open(device, O_RDWR);
+   if (dev < 0)
+   {
+      perror("tdltr: failed to open the device");
+      return errno;
+   }
+
+   for (i = 0; i < NUM_SLOTS; i++)
+   {
+      slots[i].data = malloc(block);
+      if (!slots[i].data)
+      {
+         perror("tdltr: failed to allocate buffers");
+         return ENOMEM;
+      }
+   }
+   rc = pthread_create(&writer, NULL, writer_thread, NULL);
+   if (rc != 0)
+   {
+      // pthread functions return the error instead of setting errno
+      fprintf(stderr, "tdltr: failed to start the writer thread: %s\n", strerror(rc));
+      return rc;
+   }
+
+   for (i = 0; ; i = (i + 1) % NUM_SLOTS)
+   {
+      struct slot *s = &slots[i];
+      ssize_t len;
+
+      // Wait for the writer to finish with this slot before reusing it
+      pthread_mutex_lock(&lock);
+      while (s->full)
+         pthread_cond_wait(&cond, &lock);
+      pthread_mutex_unlock(&lock);
+
+      if (writer_error)
+      {
+         errno = writer_error;
+         perror("tdltr: failed to write to stdout");
+         status = writer_error;
+         break;
+      }
+
+      len = read_full(STDIN_FILENO, s->data, block);
+      if (len < 0)
+      {
+         perror("tdltr: failed to read from stdin");
+         status = errno;
+         break;
+      }
+      if (len == 0)
+         break;
+
+      if (convert(dev, s->data, len) < 0)
+      {
+         perror("tdltr: failed to convert through the device");
+         status = errno;
+         break;
+      }
+      publish(s, len);
+   }
+
+   // Tell the writer we're done once it has caught up to the next slot
+   pthread_mutex_lock(&lock);
+   while (slots[i].full)
+      pthread_cond_wait(&cond, &lock);
+   pthread_mutex_unlock(&lock);
+   publish(&slots[i], 0);
+   pthread_join(writer, NULL);
+
+   if (!status && writer_error)
+   {
+      errno = writer_error;
+      perror("tdltr: failed to write to stdout");
+      status = writer_error;
+   }
+
+   close(dev);
+   for (i = 0; i < NUM_SLOTS; i++)
+      free(slots[i].data);
+   return status;
+}
@@ -16,6 +16,8 @@
 #include<fcntl.h>
 #include<string.h>
 #include<unistd.h>
+#include<sys/ioctl.h>
+#include "tdlchar_ioctl.h"
 
 #define BUFFER_LENGTH 256               ///< The buffer length (crude but fine)
 static char receive[BUFFER_LENGTH];     ///< The receive buffer from the LKM
@@ -24,6 +26,7 @@ int main()
 {
    int ret, fd;
    char stringToSend[BUFFER_LENGTH];
+   struct tdlchar_group group;
    printf("Starting device test code example...\n");
 
    // Open the device with read/write access
@@ -33,6 +36,14 @@ int main()
       perror("Failed to open the device...");
       return errno;
    }
+   // Read back from a consumer group of our own, so another reader can't take the message
+   memset(&group, 0, sizeof(group));
+   snprintf(group.name, sizeof(group.name), "testtdlchar-%d", getpid());
+   if (ioctl(fd, TDLCHAR_IOC_JOIN_GROUP, &group) < 0)
+   {
+      perror("Failed to join a consumer group.");
+      return errno;
+   }
    printf("Type in a short string to send to the kernel module:\n");
 
    // Read in a string (with spaces).  The %[^\n]%*c uses the scanset specifiers, which are